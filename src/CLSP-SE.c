@@ -20,6 +20,12 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
@@ -37,34 +43,48 @@
 
 #define HOWNET_HASH_SIZE 180000 // HowNet有12万词，12/0.7≈18万
 
-const int vocab_hash_size = 30000000; // Maximum 30 * 0.7 = 21M words in the vocabulary
+#define VOCAB_HASH_LOAD 0.7	// the vocab hash grows beyond this load factor
 
 typedef float real;                    // Precision of float numbers
 
+/* Contiguous storage for interned strings. Words refer to their string by
+ * its offset, which stays valid when the arena grows */
+struct string_arena {
+	char *data;
+	long long size, capacity;
+	char mapped;	// data is a read-only file mapping, see @ReadVocabBinary
+};
+
 struct vocab_word {
 	long long cn;
 	int *point;
-	char *word;
+	long long word;	// offset in vocab_arenas[lang_id]
 };
 
 // -----------------   new begin
+struct string_arena sememe_arena;	// sememe and HowNet words
+
 struct sememe_word {
-	char * word;
+	long long word;
 };
 struct sememe_word sememes[MAX_SEMEME_SIZE];
 
+// Sememes of HowNet word i are hownet_sememes[hownet_offsets[i]] up to
+// hownet_sememes[hownet_offsets[i + 1] - 1]
 struct hownet_word {
-	char *word;
-	int sememe_num; // 义原数量
-	int *sememe_idx; // 义原编号
+	long long word;
 };
 struct hownet_word hownet[MAX_HOWNET_SIZE];
+long long *hownet_offsets;
+int *hownet_sememes;	// 义原编号
 
 
 char *sememe_file, *hownet_file, *save_sememe_file;
 
 int sememe_size = 0, hownet_size = 0;
 int hownet_hash[HOWNET_HASH_SIZE];
+struct vocab_hash_slot *sememe_hash;	// open addressing, see @SearchSememe
+long long sememe_hash_mask;
 
 real *sememe_vec1,
      *sememe_vec2,
@@ -76,44 +96,214 @@ real *sememe_vec1,
      *sememe_bias_ada; // AdaGrad是否需要全局变量？
 
 real SEMEME_LAMBDA = 1;
+int sememe_negative = -1;	// negative sememes per word, -1 for sememe_size / 200
+
+// -fused-aux: the mono tasks train the sememe and lexicon objectives on their
+// center word, with probability fused_keeps[lang_id][word] / 2^32, instead of
+// separate tasks walking the vocabulary (see @InitFusedAux)
+real fused_aux = 0;
+unsigned int *fused_keeps[NUM_LANG];
+// HowNet index of every Chinese word, -1 if not in HowNet, and the
+// hownet_word_count Chinese words that are in HowNet, see @InitHowNetIndex
+int *vocab_hownet;
+long long *hownet_words, hownet_word_count;
+// The lexicon entries of word w of lang_id are lexicon_entries[lang_id][i]
+// for lexicon_offsets[lang_id][w] <= i < lexicon_offsets[lang_id][w + 1]
+long long *lexicon_offsets[NUM_LANG], *lexicon_entries[NUM_LANG];
 
 // -----------------   new end
 
 char *mono_train_files[NUM_LANG], *lexicon_files[NUM_LANG],
      *output_files[NUM_LANG], *save_vocab_files[NUM_LANG],
-     *read_vocab_files[NUM_LANG];
+     *read_vocab_files[NUM_LANG], *bin_train_files[NUM_LANG],
+     *save_vocab_bin_files[NUM_LANG];
 
 struct vocab_word *vocabs[NUM_LANG];
+struct string_arena vocab_arenas[NUM_LANG];
+
+// Header of a binary vocabulary written by -save-vocab-binN. It is followed
+// by the counts (long long), the arena offsets (long long) and the hashes
+// (unsigned int) of all words, and by the string arena, which starts on a
+// page boundary so that it can be mapped directly
+#define VOCAB_FILE_VERSION 1
+struct vocab_file_header {
+	char magic[8];
+	int version;
+	int min_count;
+	long long vocab_size;
+	long long arena_offset, arena_size;
+};
 
+// Header of the embeddings written with -binary 1. The header is followed by
+// the offsets (long long) of all words into the word block, by the word block
+// itself (NUL terminated strings) and, starting at data_offset, by one row of
+// row_stride bytes per word. Rows are 64 byte aligned so that readers can map
+// the file and use the vectors in place; all values are little endian.
+// -binary 2 writes DTYPE_INT8 rows: a float scale, the float norm of the
+// quantized row (scale included) and dims int8 values, value = scale * q
+#define EMBEDDING_FILE_VERSION 1
+#define EMBEDDING_ALIGN 64
+#define DTYPE_FLOAT32 0
+#define DTYPE_INT8 1
+struct embedding_file_header {
+	char magic[8];
+	int version;
+	int dtype;
+	long long count, dims;
+	long long row_stride;
+	long long words_offset, words_size;
+	long long data_offset;
+};
 int binary = 0, cbow = 0, debug_mode = 2, window = 5, min_count = 5,
     num_threads = 1, min_reduce = 1;
-
-int *vocab_hashes[NUM_LANG];
+int hogbatch = 0;	// skip-gram: train a window as one minibatch, see @SkipGramBatch
+// -hot-rows: every mono task trains its own replica of the first hot_rows
+// rows of syn0 and syn1neg (the most frequent words) and merges it into the
+// shared matrices every hot_merge words, see @MergeHotRows
+#define HOT_MERGE_SUM 0
+#define HOT_MERGE_AVG 1
+long long hot_rows = 0, hot_merge = 10000;
+int hot_merge_mode = HOT_MERGE_SUM;
+
+/* Open addressing hash of a vocabulary. Every slot caches the hash of its
+ * word, so probes are rejected without touching the word string */
+struct vocab_hash_slot {
+	int idx;		// position in the vocabulary, -1 if the slot is empty
+	unsigned int hash;
+};
+struct vocab_hash_table {
+	struct vocab_hash_slot *slots;
+	long long mask;		// number of slots - 1, a power of two
+	long long used;
+};
+struct vocab_hash_table vocab_hashes[NUM_LANG];
 long long vocab_max_size = 1000, vocab_sizes[NUM_LANG], layer1_size = 40;
 long long lexicons[NUM_LANG][MAX_LEXICON_SIZE], lexicon_size;
 //Assume lang_id1 corresponds to input/source language
-char srcVocabInLexicon[MAX_VOCAB_SIZE];
-char tgtVocabInLexicon[MAX_VOCAB_SIZE];
+char *srcVocabInLexicon;
+char *tgtVocabInLexicon;
 long long train_words[NUM_LANG], word_count_actual = 0, file_sizes[NUM_LANG];
 long long lang_updates[NUM_LANG], dump_every = 0, dump_iters[NUM_LANG],
                                   epoch[NUM_LANG];
-unsigned long long next_random = 0;
-int learn_vocab_and_quit = 0, adagrad = 1;
+// Every random stream of a run (initialization, subsampling, negatives and
+// windows of each task) is derived from seed, see @TaskSeed. With
+// -deterministic the tasks of an epoch run in a fixed order, so a fixed seed
+// and thread count give the same vectors bit for bit
+unsigned long long seed = 1;
+int deterministic = 0;
+
+// Header of a training checkpoint written by -checkpoint. It is followed by
+// the vocabularies (see @WriteVocabBinary), by all parameters and AdaGrad
+// accumulators and, in a checkpoint of -checkpoint-every, by the state of
+// every task of the epoch, see @SaveCheckpoint
+#define CHECKPOINT_VERSION 3
+struct checkpoint_header {
+	char magic[8];
+	int version;
+	int adagrad;
+	int threads, tasks;		// -threads of the run, task states that follow
+	long long layer1_size, sememe_size, hownet_size;
+	long long epoch, num_epochs;	// epoch to resume in, out of num_epochs
+	long long lang_updates[NUM_LANG], epochs[NUM_LANG], dump_iters[NUM_LANG];
+	long long word_count_actual;
+	unsigned long long seed;
+	real starting_alpha;
+};
+// State of a task in a checkpoint taken in the middle of an epoch: where a
+// mono task is in its part of the corpus and in its current sentence, or
+// where an aux task is in its part of the lexicon or vocabulary
+struct checkpoint_task {
+	char done, eof;
+	int shard;
+	long long offset, word_count, last_word_count, sentence_length, sentence_position, entry;
+	unsigned long long next_random;
+	int sen[MAX_SEN_LEN + 1];
+};
+char *checkpoint_file, *resume_file;
+long long checkpoint_every = 0, train_epoch = 0;
+char checkpoint_due = 0;	// -checkpoint-every: set by @FlushUpdates, written by @PausePool
+FILE *checkpoint_fin;	// the -resume file between @OpenCheckpoint and @RestoreTasks
+struct checkpoint_header resume_header;
+int learn_vocab_and_quit = 0, adagrad = 1, use_mmap = 0, preprocess = 0;
+char *corpus_maps[NUM_LANG];	// training corpora mapped with -mmap
+
+// Header of a pre-tokenized corpus written by -preprocess. It is followed by
+// num_tokens int32 vocabulary ids, where id 0 (</s>) marks a sentence end.
+#define TOKEN_FILE_VERSION 1
+struct token_file_header {
+	char magic[8];
+	int version;
+	int min_count;
+	unsigned long long vocab_hash;	// fingerprint of the vocabulary, see @VocabFingerprint
+	long long vocab_size;
+	long long num_tokens;
+	long long num_sents;
+};
+void *token_maps[NUM_LANG];	// mapped -bin-trainN files
+int *corpus_tokens[NUM_LANG];
+long long token_counts[NUM_LANG];
+
+// Sentence index of a text corpus, kept next to it in <corpus>.idx. Every
+// entry starts at the beginning of a sentence and covers whole sentences of
+// at least SENT_INDEX_BLOCK tokens (EOLs included); sentences longer than
+// MAX_SEN_LEN tokens also get an entry after every MAX_SEN_LEN tokens, see
+// @BuildSentIndex
+#define SENT_INDEX_VERSION 2
+#define SENT_INDEX_BLOCK 64
+#define SHARDS_PER_TASK 8	// most shards of a mono task, to have something to shuffle
+struct sent_index_header {
+	char magic[8];
+	int version;
+	int block;
+	long long file_size, mtime;	// of the indexed corpus
+	long long num_entries;
+	long long num_tokens;
+};
+struct sent_index_entry {
+	long long offset;	// byte offset (token offset for -bin-trainN)
+	long long tokens;
+};
+int sent_index = 1;
+// With -sent-index the corpus of each language is split into shard_counts
+// shards of equal token counts, shard i being [shard_starts[i],
+// shard_starts[i + 1]). Mono task a of a language reads shards
+// [task_shards[a], task_shards[a + 1]) of shard_orders
+long long *shard_starts[NUM_LANG];
+int shard_counts[NUM_LANG], *shard_orders[NUM_LANG], *task_shards[NUM_LANG];
 real alpha = 0.025, starting_alpha, sample = 0, bilbowa_grad = 0;
 real *syn0s[NUM_LANG], 	//Zm: input vectors
      *syn1s[NUM_LANG], 	//Zm: not used
      *syn1negs[NUM_LANG],	//Zm: output vectors
-     *syn0grads[NUM_LANG], *syn1negGrads[NUM_LANG],	//Zm: only used in AdaGrad
      *expTable,
      *sigmoidTable;	//Zm: a look-up table for the logistic sigmoid function
 clock_t start;
+// AdaGrad accumulators, only used in AdaGrad. They hold real values, or
+// bf16 values (the upper half of a real) with -grad-precision bf16
+#define PRECISION_FP32 0
+#define PRECISION_BF16 1
+void *syn0grads[NUM_LANG], *syn1negGrads[NUM_LANG];
+int grad_precision = PRECISION_FP32;
+// With -param-precision bf16, syn0 and syn1neg are stored in syn0h and
+// syn1negh instead of syn0s and syn1negs. Their rows are read and written
+// through @LoadRow and @StoreRow
+int param_precision = PRECISION_FP32;
+unsigned short *syn0h[NUM_LANG], *syn1negh[NUM_LANG];
 
 const int table_size = 1e8;     // const across languages
 int *tables[NUM_LANG];
-int negative = 5, MONO_DONE_TRAINING = 0;
-//Zm: using MONO_DONE_TRAINING as termination criterion can be unreliable
-char ALL_MONO_DONE = 0;
-pthread_rwlock_t lock;
+// Negative samplers: the unigram table above, or an alias table of one
+// entry per word (see @InitAliasTable)
+#define SAMPLER_TABLE 0
+#define SAMPLER_ALIAS 1
+struct alias_entry {
+	unsigned int keep;	// the column keeps its own word below keep / 2^32
+	int alias;		// and gives it to this word above
+};
+struct alias_entry *alias_tables[NUM_LANG];
+int neg_sampler = SAMPLER_TABLE;
+long long sampler_bench = 0;	// draws per sampler for -sampler-bench
+int negative = 5, MONO_DONE_TRAINING = 0;	// mono tasks done in this epoch, updated atomically
+char ALL_MONO_DONE = 0;		// set atomically once all mono tasks of the epoch are done
 int MSTEP_ITER = 1;
 long long NUM_EPOCHS = 1, EARLY_STOP = 0, max_train_words;
 real *delta_pos, MATCHING_LAMBDA = 1, LEXICON_LAMBDA = 1, threshold = 0;
@@ -141,6 +331,161 @@ void InitUnigramTable(int lang_id) {
 	}
 }
 
+/* Builds the alias table of language lang_id for the same unigram^0.75
+ * distribution as @InitUnigramTable (Vose's method): column i is drawn with
+ * probability 1/V and then stands for word i or its alias */
+void InitAliasTable(int lang_id) {
+	long long vocab_size = vocab_sizes[lang_id], a, n_small = 0, n_large = 0, s, l;
+	struct alias_entry *table = alias_tables[lang_id] =
+	                                malloc(vocab_size * sizeof(struct alias_entry));
+	struct vocab_word *vocab = vocabs[lang_id];
+	double *p = malloc(vocab_size * sizeof(double)), sum = 0;
+	long long *small = malloc(vocab_size * sizeof(long long));
+	long long *large = malloc(vocab_size * sizeof(long long));
+
+	for (a = 0; a < vocab_size; a++)
+		sum += p[a] = pow(vocab[a].cn, 0.75);
+	for (a = 0; a < vocab_size; a++) {
+		p[a] = p[a] * vocab_size / sum;     // mass of word a in columns
+		table[a].alias = a;
+		if (p[a] < 1)
+			small[n_small++] = a;
+		else
+			large[n_large++] = a;
+	}
+	while (n_small > 0 && n_large > 0) {
+		s = small[--n_small];
+		l = large[n_large - 1];
+		table[s].keep = p[s] * 4294967296.0;
+		table[s].alias = l;
+		p[l] -= 1 - p[s];
+		if (p[l] < 1) {
+			n_large--;
+			small[n_small++] = l;
+		}
+	}
+	// what is left is 1 up to rounding
+	while (n_large > 0)
+		table[large[--n_large]].keep = 0xFFFFFFFF;
+	while (n_small > 0)
+		table[small[--n_small]].keep = 0xFFFFFFFF;
+	free(p);
+	free(small);
+	free(large);
+}
+
+/* Draws a negative sample of language lang_id from the unigram^0.75
+ * distribution, with the random state *next_random of the calling task */
+static inline long long DrawNegative(int lang_id, unsigned long long *next_random) {
+	long long target;
+	struct alias_entry *e;
+
+	*next_random = *next_random * (unsigned long long) 25214903917 + 11;
+	if (neg_sampler == SAMPLER_ALIAS) {
+		e = &alias_tables[lang_id][((*next_random >> 32) * vocab_sizes[lang_id]) >> 32];
+		*next_random = *next_random * (unsigned long long) 25214903917 + 11;
+		target = (unsigned int) (*next_random >> 16) < e->keep ? e - alias_tables[lang_id] : e->alias;
+	} else
+		target = tables[lang_id][(*next_random >> 16) % table_size];
+	if (target == 0) // 选出</S>，则重新选
+		target = *next_random % (vocab_sizes[lang_id] - 1) + 1;
+	return target;
+}
+
+/* -sampler-bench: draws sampler_bench negatives of every language with both
+ * samplers and reports their throughput and the total variation distance of
+ * the draws to the exact unigram^0.75 distribution, against the distance
+ * sampling noise alone would give */
+void BenchSamplers() {
+	int lang_id, sampler, saved = neg_sampler;
+	long long a, vocab_size, *counts;
+	unsigned long long next_random = seed;
+	double sum, tv, noise, *p;
+	struct timespec t0, t1;
+	volatile long long sink = 0;
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		vocab_size = vocab_sizes[lang_id];
+		p = malloc(vocab_size * sizeof(double));
+		counts = malloc(vocab_size * sizeof(long long));
+		sum = noise = 0;
+		for (a = 0; a < vocab_size; a++)
+			sum += p[a] = pow(vocabs[lang_id][a].cn, 0.75);
+		// a word drawn in place of </s> gets 1 / (V - 1) of its mass
+		for (a = 1; a < vocab_size; a++)
+			p[a] = p[a] / sum + p[0] / sum / (vocab_size - 1);
+		p[0] = 0;
+		for (a = 1; a < vocab_size; a++)
+			noise += sqrt(p[a] * (1 - p[a]) / sampler_bench);
+		for (sampler = SAMPLER_TABLE; sampler <= SAMPLER_ALIAS; sampler++) {
+			neg_sampler = sampler;
+			for (a = 0; a < sampler_bench; a++)
+				sink += DrawNegative(lang_id, &next_random);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (a = 0; a < sampler_bench; a++)
+				sink += DrawNegative(lang_id, &next_random);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			memset(counts, 0, vocab_size * sizeof(long long));
+			for (a = 0; a < sampler_bench; a++)
+				counts[DrawNegative(lang_id, &next_random)]++;
+			tv = 0;
+			for (a = 0; a < vocab_size; a++)
+				tv += fabs(counts[a] / (double) sampler_bench - p[a]);
+			fprintf(stderr, "Language %d, %s sampler: %.1fM draws/s, total variation %.5f "
+			        "(sampling noise about %.5f), %lld KB\n", lang_id + 1,
+			        sampler == SAMPLER_ALIAS ? "alias" : "table",
+			        sampler_bench / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9) / 1e6,
+			        tv / 2, noise / 2 * sqrt(2 / M_PI),
+			        (sampler == SAMPLER_ALIAS ? vocab_size * (long long) sizeof(struct alias_entry)
+			         : table_size * (long long) sizeof(int)) >> 10);
+		}
+		free(p);
+		free(counts);
+	}
+	neg_sampler = saved;
+}
+
+/* Copies str to the end of the arena and returns its offset */
+long long ArenaAdd(struct string_arena *arena, char *str) {
+	long long offset = arena->size, length = strlen(str) + 1;
+	long long capacity = arena->capacity * 2 + length + 4096;
+	char *data;
+	if (arena->mapped || arena->size + length > arena->capacity) {
+		if (arena->mapped) {
+			// copy a mapped arena to the heap before it grows
+			data = malloc(capacity);
+			if (data != NULL)
+				memcpy(data, arena->data, arena->size);
+			munmap(arena->data, arena->capacity);
+			arena->mapped = 0;
+		} else
+			data = realloc(arena->data, capacity);
+		arena->capacity = capacity;
+		arena->data = data;
+		if (arena->data == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+	}
+	memcpy(arena->data + offset, str, length);
+	arena->size += length;
+	return offset;
+}
+
+/* Releases all strings of the arena at once */
+void ArenaFree(struct string_arena *arena) {
+	if (arena->mapped)
+		munmap(arena->data, arena->capacity);
+	else
+		free(arena->data);
+	memset(arena, 0, sizeof(struct string_arena));
+}
+
+/* Returns the string of word i in the vocabulary of lang_id */
+char *VocabWord(int lang_id, long long i) {
+	return vocab_arenas[lang_id].data + vocabs[lang_id][i].word;
+}
+
 /* Reads a single word from a file, assuming space + tab + EOL to be word
  boundaries */
 void ReadWord(char *word, FILE *fin) {
@@ -169,40 +514,111 @@ void ReadWord(char *word, FILE *fin) {
 	word[a] = 0; // 在字符串结尾加上终止符v
 }
 
+/* Mixes the running hash of a word, so that its low bits can index a table
+ * whose size is a power of two */
+unsigned int FinishWordHash(unsigned long long hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return (unsigned int) hash;
+}
+
 /* Returns hash value of a word */
-int GetWordHash(char *word) {
-	unsigned long long a, hash = 0;
-	for (a = 0; a < strlen(word); a++)
-		hash = hash * 257 + word[a];
-	hash = hash % vocab_hash_size;
-	return hash;
+unsigned int GetWordHash(char *word) {
+	unsigned long long hash = 0;
+	char *p;
+	for (p = word; *p; p++)
+		hash = hash * 257 + *p;
+	return FinishWordHash(hash);
 }
 
 int GetHowNetHash(char *word) {
-	unsigned long long a, hash = 0;
-	for (a = 0; a < strlen(word); a++)
-		hash = hash * 257 + word[a];
+	unsigned long long hash = 0;
+	char *p;
+	for (p = word; *p; p++)
+		hash = hash * 257 + *p;
 	hash = hash % HOWNET_HASH_SIZE;
 	return hash;
 }
 
-/* Returns position of a word in the vocabulary; if the word is not found,
- * returns -1 */
-int SearchVocab(int lang_id, char *word) {
-	unsigned int hash = GetWordHash(word);
-	//if (lang_id >= NUM_LANG) { printf("lang_id >= NUM_LANG\n"); exit(1); }
-	int *vocab_hash = vocab_hashes[lang_id];
+/* Empties the vocab hash of lang_id and sizes it for expected words */
+void InitVocabHash(int lang_id, long long expected) {
+	struct vocab_hash_table *table = &vocab_hashes[lang_id];
+	long long a, size = 1024;
+	while (size * VOCAB_HASH_LOAD < expected)
+		size *= 2;
+	free(table->slots);
+	table->slots = malloc(size * sizeof(struct vocab_hash_slot));
+	if (table->slots == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < size; a++)
+		table->slots[a].idx = -1;
+	table->mask = size - 1;
+	table->used = 0;
+}
+
+/* Adds vocabulary position idx under hash, doubling the table when the load
+ * factor would exceed VOCAB_HASH_LOAD. Growing only moves the cached hashes,
+ * no word is hashed again */
+void VocabHashInsert(int lang_id, int idx, unsigned int hash) {
+	struct vocab_hash_table *table = &vocab_hashes[lang_id];
+	struct vocab_hash_slot *old = table->slots;
+	long long a, slot, old_size = table->mask + 1;
+
+	if (table->used + 1 > old_size * VOCAB_HASH_LOAD) {
+		table->slots = malloc(old_size * 2 * sizeof(struct vocab_hash_slot));
+		if (table->slots == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		table->mask = old_size * 2 - 1;
+		for (a = 0; a <= table->mask; a++)
+			table->slots[a].idx = -1;
+		for (a = 0; a < old_size; a++) {
+			if (old[a].idx == -1)
+				continue;
+			slot = old[a].hash & table->mask;
+			while (table->slots[slot].idx != -1)
+				slot = (slot + 1) & table->mask;
+			table->slots[slot] = old[a];
+		}
+		free(old);
+	}
+	slot = hash & table->mask;
+	while (table->slots[slot].idx != -1)
+		slot = (slot + 1) & table->mask;
+	table->slots[slot].idx = idx;
+	table->slots[slot].hash = hash;
+	table->used++;
+}
+
+/* Returns position of a word whose hash is already known in the vocabulary;
+ * if the word is not found, returns -1 */
+int SearchVocabHash(int lang_id, char *word, unsigned int hash) {
+	struct vocab_hash_table *table = &vocab_hashes[lang_id];
+	struct vocab_hash_slot *slot;
 	struct vocab_word *vocab = vocabs[lang_id];
+	long long pos = hash & table->mask;
 	while (1) {
-		if (vocab_hash[hash] == -1)
+		slot = &table->slots[pos];
+		if (slot->idx == -1)
 			return -1;
-		if (!strcmp(word, vocab[vocab_hash[hash]].word))
-			return vocab_hash[hash];
-		hash = (hash + 1) % vocab_hash_size;
+		if (slot->hash == hash && !strcmp(word, vocab_arenas[lang_id].data + vocab[slot->idx].word))
+			return slot->idx;
+		pos = (pos + 1) & table->mask;
 	}
 	return -1;
 }
 
+/* Returns position of a word in the vocabulary; if the word is not found,
+ * returns -1 */
+int SearchVocab(int lang_id, char *word) {
+	//if (lang_id >= NUM_LANG) { printf("lang_id >= NUM_LANG\n"); exit(1); }
+	return SearchVocabHash(lang_id, word, GetWordHash(word));
+}
+
 /* Reads a word and returns its index in the vocabulary */
 int ReadWordIndex(FILE *fin, int lang_id) {
 	char word[MAX_STRING];
@@ -212,6 +628,80 @@ int ReadWordIndex(FILE *fin, int lang_id) {
 	return SearchVocab(lang_id, word);         // MOD
 }
 
+/* Same as @ReadWord, but scans the memory between *pos and end instead of a
+ * stream. The word hash is accumulated on the way so that the caller does not
+ * have to hash the word again. Returns 1 when the end of the buffer has been
+ * hit, which plays the role of feof() */
+char ReadWordMem(char *word, unsigned int *hash, char **pos, char *end) {
+	int a = 0, truncated = 0;
+	char ch, *p = *pos;
+	unsigned long long h = 0;
+	while (1) {
+		if (p >= end) {
+			word[a] = 0;
+			*pos = p;
+			return 1;
+		}
+		ch = *p++;
+		if (ch == 13)
+			continue;
+		if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
+			if (a > 0) {
+				if (ch == '\n')
+					p--; // leave EOL for the next call
+				break;
+			}
+			if (ch == '\n') {
+				strcpy(word, (char *) "</s>");
+				*pos = p;
+				*hash = GetWordHash(word);
+				return 0;
+			} else
+				continue;
+		}
+		word[a] = ch;
+		h = h * 257 + ch;
+		a++;
+		if (a >= MAX_STRING - 1) {
+			a--;   // Truncate too long words
+			truncated = 1;
+		}
+	}
+	word[a] = 0;
+	*pos = p;
+	*hash = truncated ? GetWordHash(word) : FinishWordHash(h);
+	return 0;
+}
+
+/* Maps the training corpus of language lang_id into memory for -mmap */
+void MapTrainFile(int lang_id) {
+	struct stat st;
+	char *train_file = mono_train_files[lang_id];
+	int fd = open(train_file, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("ERROR: training data file (%s) not found!\n", train_file);
+		exit(1);
+	}
+	file_sizes[lang_id] = st.st_size;
+	corpus_maps[lang_id] = NULL;
+	if (st.st_size > 0) {
+		corpus_maps[lang_id] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (corpus_maps[lang_id] == MAP_FAILED) {
+			printf("ERROR: cannot map training data file (%s)!\n", train_file);
+			exit(1);
+		}
+		madvise(corpus_maps[lang_id], st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+}
+
+void UnmapTrainFile(int lang_id) {
+	if (corpus_maps[lang_id] != NULL)
+		munmap(corpus_maps[lang_id], file_sizes[lang_id]);
+	corpus_maps[lang_id] = NULL;
+}
+
 /* Reads a single word from a file, assuming space + tab + EOL to be word
  boundaries. Unlike @ReadWord, this does not treat EOL to be special. */
 void ReadWordNoEOL(char *word, FILE *fin) {
@@ -248,14 +738,9 @@ int ReadWordIndexNoEOL(FILE *fin, int lang_id) {
 
 /* Adds a word to the vocabulary */
 int AddWordToVocab(int lang_id, char *word) {
-	unsigned int hash, length = strlen(word) + 1;
 	struct vocab_word *vocab = vocabs[lang_id];
-	int *vocab_hash = vocab_hashes[lang_id];      // array of *ints
 
-	if (length > MAX_STRING)
-		length = MAX_STRING;
-	vocab[vocab_sizes[lang_id]].word = calloc(length, sizeof(char));
-	strcpy(vocab[vocab_sizes[lang_id]].word, word);
+	vocab[vocab_sizes[lang_id]].word = ArenaAdd(&vocab_arenas[lang_id], word);
 	vocab[vocab_sizes[lang_id]].cn = 0;
 	vocab_sizes[lang_id]++;
 	// Reallocate memory if needed
@@ -264,91 +749,405 @@ int AddWordToVocab(int lang_id, char *word) {
 		vocabs[lang_id] = (struct vocab_word *) realloc(vocabs[lang_id],
 		                  vocab_max_size * sizeof(struct vocab_word));
 	}
-	hash = GetWordHash(word);
-	while (vocab_hash[hash] != -1)
-		hash = (hash + 1) % vocab_hash_size;
-	vocab_hash[hash] = vocab_sizes[lang_id] - 1;
+	VocabHashInsert(lang_id, vocab_sizes[lang_id] - 1, GetWordHash(word));
 	return vocab_sizes[lang_id] - 1;
 }
 
+/* Entry of the frequency sort in @SortVocab. Words with equal counts keep
+ * their relative order, given by order, so the result does not depend on how
+ * the words were split into runs */
+struct vocab_sort_entry {
+	long long cn, order;
+	char *word;
+};
+
+/* A part of the vocabulary that is filtered and sorted by one thread */
+struct vocab_sort_run {
+	struct vocab_sort_entry *entries;
+	long long size;
+};
+
 /* Used later for sorting by word counts */
 int VocabCompare(const void *word1, const void *word2) {
-	return ((struct vocab_word *) word2)->cn - ((struct vocab_word *) word1)->cn;
+	const struct vocab_sort_entry *w1 = word1, *w2 = word2;
+	if (w1->cn != w2->cn)
+		return w1->cn < w2->cn ? 1 : -1;
+	return (w1->order > w2->order) - (w1->order < w2->order);
+}
+
+/* Drops the words occuring less than min_count times from a run and sorts
+ * the remaining ones */
+void *SortVocabRunThread(void *arg) {
+	struct vocab_sort_run *run = arg;
+	long long a, b = 0;
+	for (a = 0; a < run->size; a++)
+		if (run->entries[a].cn >= min_count)
+			run->entries[b++] = run->entries[a];
+	run->size = b;
+	qsort(run->entries, run->size, sizeof(struct vocab_sort_entry), VocabCompare);
+	return NULL;
+}
+
+/* Filters and sorts the runs in parallel, then merges them behind </s>
+ * into a new vocabulary of lang_id and rebuilds the hash. The words are
+ * copied to a new arena in their final order, so the caller can release the
+ * storage the entries point to in one go */
+void MergeVocabRuns(int lang_id, struct vocab_sort_entry *eos,
+                    struct vocab_sort_run *runs, int num_runs) {
+	long long a, total = 0, *heads = calloc(num_runs, sizeof(long long));
+	int r, best;
+	struct vocab_word *vocab;
+	struct string_arena *arena = &vocab_arenas[lang_id];
+	pthread_t *pt = malloc(num_runs * sizeof(pthread_t));
+
+	for (r = 0; r < num_runs; r++)
+		pthread_create(&pt[r], NULL, SortVocabRunThread, &runs[r]);
+	for (r = 0; r < num_runs; r++) {
+		pthread_join(pt[r], NULL);
+		total += runs[r].size;
+	}
+	vocabs[lang_id] = (struct vocab_word *) realloc(vocabs[lang_id],
+	                  (total + 2) * sizeof(struct vocab_word)); // 按照词表实际大小重新分配内存
+	vocab = vocabs[lang_id];
+	memset(arena, 0, sizeof(struct string_arena));
+	vocab[0].cn = eos->cn;
+	vocab[0].word = ArenaAdd(arena, eos->word);
+	vocab[0].point = NULL;
+	for (a = 1; a <= total; a++) {
+		best = -1;
+		for (r = 0; r < num_runs; r++)
+			if (heads[r] < runs[r].size && (best == -1
+			                                || VocabCompare(&runs[r].entries[heads[r]], &runs[best].entries[heads[best]]) < 0))
+				best = r;
+		vocab[a].cn = runs[best].entries[heads[best]].cn;
+		vocab[a].word = ArenaAdd(arena, runs[best].entries[heads[best]].word);
+		vocab[a].point = NULL;
+		heads[best]++;
+	}
+	vocab_sizes[lang_id] = total + 1;
+
+	InitVocabHash(lang_id, vocab_sizes[lang_id]);
+	train_words[lang_id] = 0;
+	for (a = 0; a < vocab_sizes[lang_id]; a++) {
+		// Hash will be re-computed, as after the sorting it is not correct
+		VocabHashInsert(lang_id, a, GetWordHash(arena->data + vocab[a].word));
+		train_words[lang_id] += vocab[a].cn;
+	}
+	free(heads);
+	free(pt);
 }
 
 /* Sorts the vocabulary by frequency using word counts */
 void SortVocab(int lang_id) {
-	int a, size;
-	unsigned int hash;
+	long long a, b, size = vocab_sizes[lang_id] - 1, per_run;
+	int r, num_runs = num_threads;
 	struct vocab_word *vocab = vocabs[lang_id];
-	int *vocab_hash = vocab_hashes[lang_id];
+	struct vocab_sort_entry eos;
+	struct vocab_sort_run *runs = calloc(num_runs, sizeof(struct vocab_sort_run));
+	struct string_arena old_arena = vocab_arenas[lang_id];
 
 	// Sort the vocabulary and keep </s> at the first position
-	qsort(&vocab[1], vocab_sizes[lang_id] - 1, sizeof(struct vocab_word),
-	      VocabCompare);
-
-	printf("After sorting, the first word in %lld's dict is %s\n", lang_id, vocab[0].word);
-
-	for (a = 0; a < vocab_hash_size; a++)
-		vocab_hash[a] = -1;
-	size = vocab_sizes[lang_id];
-	train_words[lang_id] = 0;
-	for (a = 0; a < size; a++) {
-		// Words occuring less than min_count times will be discarded from the vocab
-		if (vocab[a].cn < min_count) {
-			vocab_sizes[lang_id]--;
-			free(vocab[vocab_sizes[lang_id]].word);
-		} else {
-			// Hash will be re-computed, as after the sorting it is not correct
-			hash = GetWordHash(vocab[a].word);
-			while (vocab_hash[hash] != -1)
-				hash = (hash + 1) % vocab_hash_size;
-			vocab_hash[hash] = a;
-			train_words[lang_id] += vocab[a].cn;
+	per_run = size / num_runs + 1;
+	for (r = 0; r < num_runs; r++) {
+		runs[r].entries = malloc(per_run * sizeof(struct vocab_sort_entry));
+		for (a = 1 + r * per_run, b = 0; a <= size && b < per_run; a++, b++) {
+			runs[r].entries[b].cn = vocab[a].cn;
+			runs[r].entries[b].order = a;
+			runs[r].entries[b].word = old_arena.data + vocab[a].word;
 		}
+		runs[r].size = b;
 	}
-	vocabs[lang_id] = (struct vocab_word *) realloc(vocabs[lang_id],
-	                  (vocab_sizes[lang_id] + 1) * sizeof(struct vocab_word)); // 按照词表实际大小重新分配内存
+	eos.cn = vocab[0].cn;
+	eos.word = old_arena.data + vocab[0].word;
+	MergeVocabRuns(lang_id, &eos, runs, num_runs);
+	ArenaFree(&old_arena);
+
+	printf("After sorting, the first word in %d's dict is %s\n", lang_id, VocabWord(lang_id, 0));
+
+	for (r = 0; r < num_runs; r++)
+		free(runs[r].entries);
+	free(runs);
 }
 
 /* Reduces the vocabulary by removing infrequent tokens */
 void ReduceVocab(int lang_id) {
 	int a, b = 1; //确保</s>不会被删掉
-	unsigned int hash;
 	long long vocab_size = vocab_sizes[lang_id];
 	struct vocab_word *vocab = vocabs[lang_id];
-	int *vocab_hash = vocab_hashes[lang_id];
+	struct string_arena old_arena = vocab_arenas[lang_id];
 
+	// The surviving words are copied to a new arena, the old one is dropped
+	// as a whole
+	memset(&vocab_arenas[lang_id], 0, sizeof(struct string_arena));
+	vocab[0].word = ArenaAdd(&vocab_arenas[lang_id], old_arena.data + vocab[0].word);
 	for (a = 1; a < vocab_size; a++) // 压缩词表，把词频小于等于min_reduce的词都删掉
 		if (vocab[a].cn > min_reduce ) {
 			vocab[b].cn = vocab[a].cn;
-			vocab[b].word = vocab[a].word;
+			vocab[b].word = ArenaAdd(&vocab_arenas[lang_id], old_arena.data + vocab[a].word);
 			b++;
-		} else
-			free(vocab[a].word);
+		}
 	vocab_sizes[lang_id] = b;
+	ArenaFree(&old_arena);
 	// 重新计算哈希值
-	for (a = 0; a < vocab_hash_size; a++)
-		vocab_hash[a] = -1;
-	for (a = 0; a < vocab_size; a++) {
+	InitVocabHash(lang_id, b);
+	for (a = 0; a < b; a++)
 		// Hash will be re-computed, as it is not correct
-		hash = GetWordHash(vocab[a].word);
-		while (vocab_hash[hash] != -1)
-			hash = (hash + 1) % vocab_hash_size;
-		vocab_hash[hash] = a;
-	}
+		VocabHashInsert(lang_id, a, GetWordHash(VocabWord(lang_id, a)));
 	fflush(stdout);
 	min_reduce++;
 }
 
+/* Word counts of one byte range of a training corpus, see
+ * @LearnVocabParallel. The same structure holds one hash partition of the
+ * counts while the shards are merged */
+struct vocab_shard {
+	int lang_id, id;
+	char *begin, *end;	// words starting in [begin, end) belong to the shard
+	struct vocab_word *words;	// strings are kept in arena
+	struct string_arena arena;
+	long long *first;	// offset of the first occurrence of every word
+	unsigned int *hashes;
+	int *table;		// open addressing into words, size is a power of two
+	long long size, max_size, table_mask, words_read;
+};
+struct vocab_shard *vocab_shards;
+
+/* Returns the position of word in the shard, or -1 */
+long long ShardSearch(struct vocab_shard *sh, char *word, unsigned int hash) {
+	long long slot = hash & sh->table_mask;
+	while (sh->table[slot] != -1) {
+		if (sh->hashes[sh->table[slot]] == hash
+		        && !strcmp(word, sh->arena.data + sh->words[sh->table[slot]].word))
+			return sh->table[slot];
+		slot = (slot + 1) & sh->table_mask;
+	}
+	return -1;
+}
+
+/* Rebuilds the open addressing table of a shard from the cached hashes,
+ * doubling it when it gets more than 70% full */
+void ShardRehash(struct vocab_shard *sh) {
+	long long a, slot;
+	while (sh->size > (sh->table_mask + 1) * 0.7)
+		sh->table_mask = sh->table_mask * 2 + 1;
+	sh->table = realloc(sh->table, (sh->table_mask + 1) * sizeof(int));
+	for (a = 0; a <= sh->table_mask; a++)
+		sh->table[a] = -1;
+	for (a = 0; a < sh->size; a++) {
+		slot = sh->hashes[a] & sh->table_mask;
+		while (sh->table[slot] != -1)
+			slot = (slot + 1) & sh->table_mask;
+		sh->table[slot] = a;
+	}
+}
+
+/* Adds a word to the shard */
+void ShardAdd(struct vocab_shard *sh, char *word, unsigned int hash,
+              long long first, long long cn) {
+	long long slot;
+	if (sh->size >= sh->max_size) {
+		sh->max_size = sh->max_size * 2 + 1000;
+		sh->words = realloc(sh->words, sh->max_size * sizeof(struct vocab_word));
+		sh->first = realloc(sh->first, sh->max_size * sizeof(long long));
+		sh->hashes = realloc(sh->hashes, sh->max_size * sizeof(unsigned int));
+	}
+	sh->words[sh->size].word = ArenaAdd(&sh->arena, word);
+	sh->words[sh->size].cn = cn;
+	sh->first[sh->size] = first;
+	sh->hashes[sh->size] = hash;
+	sh->size++;
+	if (sh->size > (sh->table_mask + 1) * 0.7) {
+		ShardRehash(sh);
+		return;
+	}
+	slot = hash & sh->table_mask;
+	while (sh->table[slot] != -1)
+		slot = (slot + 1) & sh->table_mask;
+	sh->table[slot] = sh->size - 1;
+}
+
+/* Counts the words starting in the byte range of one shard. A word crossing
+ * the end of the range is read to its end; the shard that starts in the
+ * middle of it skips it. Stops early once the shard alone holds more than
+ * MAX_VOCAB_SIZE words, see @LearnVocabParallel */
+void *CountVocabThread(void *arg) {
+	struct vocab_shard *sh = arg;
+	char word[MAX_STRING], *base = corpus_maps[sh->lang_id], *p = sh->begin, *q;
+	char *file_end = base + file_sizes[sh->lang_id];
+	unsigned int hash;
+	long long i, start;
+
+	sh->max_size = 0;
+	sh->table_mask = 1023;
+	ShardRehash(sh);
+	if (p > base) {
+		for (q = p - 1; q > base && *q == 13; q--)
+			;
+		if (*q != ' ' && *q != '\t' && *q != '\n' && *q != 13)
+			while (p < file_end && *p != ' ' && *p != '\t' && *p != '\n')
+				p++;
+	}
+	while (1) {
+		while (p < file_end && (*p == ' ' || *p == '\t' || *p == 13))
+			p++;
+		if (p >= sh->end)
+			break;
+		start = p - base;
+		if (ReadWordMem(word, &hash, &p, file_end))
+			break;
+		sh->words_read++;
+		i = ShardSearch(sh, word, hash);
+		if (i == -1)
+			ShardAdd(sh, word, hash, start, 1);
+		else
+			sh->words[i].cn++;
+		if (sh->size > MAX_VOCAB_SIZE)
+			break;
+	}
+	return NULL;
+}
+
+/* Collects the counts of one hash partition from all shards. Shards are
+ * visited in file order, so a word keeps the offset of its first occurrence */
+void *MergeVocabThread(void *arg) {
+	struct vocab_shard *part = arg, *sh;
+	long long a, i;
+	int s;
+	char *word;
+
+	part->max_size = 0;
+	part->table_mask = 1023;
+	ShardRehash(part);
+	for (s = 0; s < num_threads; s++) {
+		sh = &vocab_shards[s];
+		for (a = 0; a < sh->size; a++) {
+			if (sh->hashes[a] % num_threads != part->id)
+				continue;
+			word = sh->arena.data + sh->words[a].word;
+			i = ShardSearch(part, word, sh->hashes[a]);
+			if (i == -1)
+				ShardAdd(part, word, sh->hashes[a], sh->first[a], sh->words[a].cn);
+			else
+				part->words[i].cn += sh->words[a].cn;
+		}
+	}
+	return NULL;
+}
+
+/* Frees n shards or hash partitions */
+void FreeVocabShards(struct vocab_shard *sh, int n) {
+	int t;
+	for (t = 0; t < n; t++) {
+		free(sh[t].words);
+		free(sh[t].first);
+		free(sh[t].hashes);
+		free(sh[t].table);
+		ArenaFree(&sh[t].arena);
+	}
+	free(sh);
+}
+
+/* Builds the vocabulary with num_threads threads, each counting one byte
+ * range of the mapped corpus into its own shard. The shards are merged by
+ * hash partition and then sorted by @MergeVocabRuns, using the first
+ * occurrence to order words of equal count, which gives the same vocabulary
+ * as the sequential pass. That pass prunes rare words as soon as the corpus
+ * has more than MAX_VOCAB_SIZE distinct words, which depends on the order
+ * of the words; such corpora are left to it and 0 is returned */
+int LearnVocabParallel(int lang_id) {
+	int t;
+	long long a, b, total;
+	char *base;
+	struct vocab_shard *parts;
+	struct vocab_sort_entry eos;
+	struct vocab_sort_run *runs;
+	pthread_t *pt = malloc(num_threads * sizeof(pthread_t));
+
+	MapTrainFile(lang_id);
+	base = corpus_maps[lang_id];
+	vocab_shards = calloc(num_threads, sizeof(struct vocab_shard));
+	parts = calloc(num_threads, sizeof(struct vocab_shard));
+	for (t = 0; t < num_threads; t++) {
+		vocab_shards[t].lang_id = lang_id;
+		vocab_shards[t].id = t;
+		vocab_shards[t].begin = base + file_sizes[lang_id] / num_threads * t;
+		vocab_shards[t].end = base + file_sizes[lang_id] / num_threads * (t + 1);
+		if (t == num_threads - 1)
+			vocab_shards[t].end = base + file_sizes[lang_id];
+		pthread_create(&pt[t], NULL, CountVocabThread, &vocab_shards[t]);
+	}
+	train_words[lang_id] = 0;
+	total = 0;
+	for (t = 0; t < num_threads; t++) {
+		pthread_join(pt[t], NULL);
+		train_words[lang_id] += vocab_shards[t].words_read;
+		if (vocab_shards[t].size > MAX_VOCAB_SIZE)
+			total = vocab_shards[t].size;
+	}
+	if (total <= MAX_VOCAB_SIZE) {
+		for (t = 0; t < num_threads; t++) {
+			parts[t].id = t;
+			pthread_create(&pt[t], NULL, MergeVocabThread, &parts[t]);
+		}
+		for (t = 0; t < num_threads; t++)
+			pthread_join(pt[t], NULL);
+		for (t = 0; t < num_threads; t++)
+			total += parts[t].size;
+	}
+	FreeVocabShards(vocab_shards, num_threads);
+	if (total > MAX_VOCAB_SIZE) {
+		FreeVocabShards(parts, num_threads);
+		free(pt);
+		UnmapTrainFile(lang_id);
+		train_words[lang_id] = 0;
+		if (debug_mode > 0)
+			fprintf(stderr, "More than %d distinct words, counting sequentially\n", MAX_VOCAB_SIZE);
+		return 0;
+	}
+	if (debug_mode > 1)
+		fprintf(stderr, "%lldK\n", train_words[lang_id] / 1000);
+
+	eos.cn = 0;
+	eos.word = (char *) "</s>";
+	runs = calloc(num_threads, sizeof(struct vocab_sort_run));
+	for (t = 0; t < num_threads; t++) {
+		runs[t].entries = malloc((parts[t].size + 1) * sizeof(struct vocab_sort_entry));
+		for (a = 0, b = 0; a < parts[t].size; a++) {
+			if (!strcmp(parts[t].arena.data + parts[t].words[a].word, "</s>")) {
+				eos.cn = parts[t].words[a].cn;
+				continue;
+			}
+			runs[t].entries[b].cn = parts[t].words[a].cn;
+			runs[t].entries[b].order = parts[t].first[a];
+			runs[t].entries[b].word = parts[t].arena.data + parts[t].words[a].word;
+			b++;
+		}
+		runs[t].size = b;
+	}
+	ArenaFree(&vocab_arenas[lang_id]);
+	MergeVocabRuns(lang_id, &eos, runs, num_threads);
+	for (t = 0; t < num_threads; t++)
+		free(runs[t].entries);
+	FreeVocabShards(parts, num_threads);
+	free(runs);
+	free(pt);
+	UnmapTrainFile(lang_id);
+
+	if (debug_mode > 0) {
+		fprintf(stderr, "Vocab size: %lld\n", vocab_sizes[lang_id]);
+		fprintf(stderr, "Words in train file: %lld\n", train_words[lang_id]);
+	}
+	return 1;
+}
+
 void LearnVocabFromTrainFile(int lang_id) {
 	char word[MAX_STRING], *train_file = mono_train_files[lang_id];
 	FILE *fin;
 	long long a, i;
-	int *vocab_hash = vocab_hashes[lang_id];
 	struct vocab_word *vocab = vocabs[lang_id];
-	for (a = 0; a < vocab_hash_size; a++)
-		vocab_hash[a] = -1;
+	if (EARLY_STOP == 0 && LearnVocabParallel(lang_id)) // EARLY_STOP needs the words in file order
+		return;
+	InitVocabHash(lang_id, 0);
 	fin = fopen(train_file, "rb");
 	if (fin == NULL) {
 		printf("ERROR: training data (%s) file not found (lang_id==%d)!\n",
@@ -380,16 +1179,17 @@ void LearnVocabFromTrainFile(int lang_id) {
 			vocab[a].cn = 1;
 		} else
 			vocab[i].cn++;
-		if (vocab_sizes[lang_id] > vocab_hash_size * 0.7) {
+		if (vocab_sizes[lang_id] > MAX_VOCAB_SIZE) {
 			ReduceVocab(lang_id); // 每次添加后都会检查！如果一直超会导致min_reduce一直增加
 		}
 	}
-	printf("The first word in language %lld is %s\n", lang_id, vocab[0].word);
+	printf("The first word in language %d is %s\n", lang_id, VocabWord(lang_id, 0));
 
 	fprintf(stderr, "pre SortVocab\n");
 	SortVocab(lang_id);
+	vocab = vocabs[lang_id];
 
-	printf("The first word in language %lld is %s\n", lang_id, vocab[0].word);
+	printf("The first word in language %d is %s\n", lang_id, VocabWord(lang_id, 0));
 
 	if (debug_mode > 0) {
 		fprintf(stderr, "Vocab size: %lld\n", vocab_sizes[lang_id]);
@@ -408,16 +1208,128 @@ void SaveVocab(int lang_id) {
 	fprintf(stderr, "Saving vocabulary with %lld entries to %s\n", vocab_sizes[lang_id],
 	        save_vocab_file);
 	for (i = 0; i < vocab_sizes[lang_id]; i++)
-		fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
+		fprintf(fo, "%s %lld\n", VocabWord(lang_id, i), vocab[i].cn);
+	fclose(fo);
+}
+
+/* Writes the vocabulary of lang_id together with its string arena at the
+ * current position of fo, see struct vocab_file_header */
+void WriteVocabBinary(int lang_id, FILE *fo) {
+	struct vocab_file_header header;
+	long long a, size = vocab_sizes[lang_id];
+	unsigned int hash;
+	struct vocab_word *vocab = vocabs[lang_id];
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CLSPVOC", 8);
+	header.version = VOCAB_FILE_VERSION;
+	header.min_count = min_count;
+	header.vocab_size = size;
+	header.arena_offset = ftell(fo) + sizeof(header)
+	                      + size * (2 * sizeof(long long) + sizeof(unsigned int));
+	header.arena_offset = (header.arena_offset + 4095) / 4096 * 4096;
+	header.arena_size = vocab_arenas[lang_id].size;
+	fwrite(&header, sizeof(header), 1, fo);
+	for (a = 0; a < size; a++)
+		fwrite(&vocab[a].cn, sizeof(long long), 1, fo);
+	for (a = 0; a < size; a++)
+		fwrite(&vocab[a].word, sizeof(long long), 1, fo);
+	for (a = 0; a < size; a++) {
+		hash = GetWordHash(VocabWord(lang_id, a));
+		fwrite(&hash, sizeof(unsigned int), 1, fo);
+	}
+	fseek(fo, header.arena_offset, SEEK_SET);
+	fwrite(vocab_arenas[lang_id].data, 1, header.arena_size, fo);
+}
+
+void SaveVocabBinary(int lang_id) {
+	char *file = save_vocab_bin_files[lang_id];
+	FILE *fo = fopen(file, "wb");
+
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s for writing!\n", file);
+		exit(1);
+	}
+	fprintf(stderr, "Saving binary vocabulary with %lld entries to %s\n", vocab_sizes[lang_id], file);
+	WriteVocabBinary(lang_id, fo);
 	fclose(fo);
 }
 
+/* Loads a vocabulary written by @WriteVocabBinary from the current position
+ * of fin, which is left behind the vocabulary. The string arena is mapped
+ * from the file and the hash is rebuilt from the stored hashes, so no word is
+ * copied or hashed. Returns the min_count the vocabulary was built with */
+int ReadVocabBinary(int lang_id, FILE *fin, char *name) {
+	struct vocab_file_header header;
+	long long a, size;
+	long long *cns, *words;
+	unsigned int *hashes;
+	struct string_arena *arena = &vocab_arenas[lang_id];
+
+	if (fread(&header, sizeof(header), 1, fin) != 1 || header.version != VOCAB_FILE_VERSION) {
+		printf("ERROR: %s is not a binary vocabulary!\n", name);
+		exit(1);
+	}
+	size = header.vocab_size;
+	cns = malloc(size * sizeof(long long));
+	words = malloc(size * sizeof(long long));
+	hashes = malloc(size * sizeof(unsigned int));
+	if (fread(cns, sizeof(long long), size, fin) != size
+	        || fread(words, sizeof(long long), size, fin) != size
+	        || fread(hashes, sizeof(unsigned int), size, fin) != size) {
+		printf("ERROR: %s is truncated!\n", name);
+		exit(1);
+	}
+	ArenaFree(arena);
+	if (header.arena_size > 0) {
+		arena->data = mmap(NULL, header.arena_size, PROT_READ, MAP_PRIVATE,
+		                   fileno(fin), header.arena_offset);
+		if (arena->data == MAP_FAILED) {
+			printf("ERROR: cannot map the strings of %s!\n", name);
+			exit(1);
+		}
+		arena->size = arena->capacity = header.arena_size;
+		arena->mapped = 1;
+	}
+	fseek(fin, header.arena_offset + header.arena_size, SEEK_SET);
+
+	vocabs[lang_id] = (struct vocab_word *) realloc(vocabs[lang_id],
+	                  (size + 1) * sizeof(struct vocab_word));
+	InitVocabHash(lang_id, size);
+	train_words[lang_id] = 0;
+	for (a = 0; a < size; a++) {
+		vocabs[lang_id][a].cn = cns[a];
+		vocabs[lang_id][a].word = words[a];
+		vocabs[lang_id][a].point = NULL;
+		VocabHashInsert(lang_id, a, hashes[a]);
+		train_words[lang_id] += cns[a];
+	}
+	vocab_sizes[lang_id] = size;
+	free(cns);
+	free(words);
+	free(hashes);
+	return header.min_count;
+}
+
+/* Sets file_sizes[lang_id] from the text corpus of lang_id */
+void GetTrainFileSize(int lang_id) {
+	char *train_file = mono_train_files[lang_id];
+	FILE *fin = fopen(train_file, "rb");
+
+	if (fin == NULL) {
+		printf("ERROR: training data file (%s) not found!\n", train_file);
+		exit(1);
+	}
+	fseek(fin, 0, SEEK_END);
+	file_sizes[lang_id] = ftell(fin);
+	fclose(fin);
+}
+
 void ReadVocab(int lang_id) {
 	long long a, i = 0;
+	int vocab_min_count;
 	char c;
 	char word[MAX_STRING];
-	int *vocab_hash = vocab_hashes[lang_id];
-	char *train_file = mono_train_files[lang_id];
 	FILE *fin = fopen(read_vocab_files[lang_id], "rb");
 
 	if (fin == NULL) {
@@ -425,30 +1337,37 @@ void ReadVocab(int lang_id) {
 		exit(1);
 	}
 
-	for (a = 0; a < vocab_hash_size; a++)
-		vocab_hash[a] = -1;
-	vocab_sizes[lang_id] = 0;
-	while (1) {
-		ReadWord(word, fin);
-		if (feof(fin))
-			break;
-		a = AddWordToVocab(lang_id, word);      // can change vocabs
-		fscanf(fin, "%lld%c", &vocabs[lang_id][a].cn, &c);
-		i++;
+	if (fread(word, 1, 8, fin) == 8 && !memcmp(word, "CLSPVOC", 8)) {
+		rewind(fin);
+		vocab_min_count = ReadVocabBinary(lang_id, fin, read_vocab_files[lang_id]);
+		if (vocab_min_count != min_count) {
+			if (vocab_min_count > min_count)
+				fprintf(stderr, "WARNING: %s only has words seen at least %d times\n",
+				        read_vocab_files[lang_id], vocab_min_count);
+			SortVocab(lang_id);
+		}
+	} else {
+		rewind(fin);
+		InitVocabHash(lang_id, 0);
+		vocab_sizes[lang_id] = 0;
+		while (1) {
+			ReadWord(word, fin);
+			if (feof(fin))
+				break;
+			a = AddWordToVocab(lang_id, word);      // can change vocabs
+			fscanf(fin, "%lld%c", &vocabs[lang_id][a].cn, &c);
+			i++;
+		}
+		SortVocab(lang_id);
 	}
-	SortVocab(lang_id);
+	fclose(fin);
 	if (debug_mode > 0) {
 		fprintf(stderr, "Vocab size: %lld\n", vocab_sizes[lang_id]);
 		fprintf(stderr, "Words in train file: %lld\n", train_words[lang_id]);
 	}
-	fin = fopen(train_file, "rb");
-	if (fin == NULL) {
-		printf("ERROR: training data file (%s) not found!\n", train_file);
-		exit(1);
-	}
-	fseek(fin, 0, SEEK_END);
-	file_sizes[lang_id] = ftell(fin);
-	fclose(fin);
+	if (bin_train_files[lang_id][0] != 0 && !preprocess)
+		return;         // the text corpus is not needed, see @MapTokenFile
+	GetTrainFileSize(lang_id);
 }
 
 void LoadLexicon() {
@@ -460,11 +1379,8 @@ void LoadLexicon() {
 		printf("ERROR: lexicon file not found!\n");
 		exit(1);
 	}
-	int j;
-	for (j = 0; j < MAX_VOCAB_SIZE; j++) {
-		srcVocabInLexicon[j] = 0;
-		tgtVocabInLexicon[j] = 0;
-	}
+	srcVocabInLexicon = calloc(vocab_sizes[0], sizeof(char));
+	tgtVocabInLexicon = calloc(vocab_sizes[1], sizeof(char));
 	lexicon_size = 0;
 	i0 = SearchVocab(0, (char *) "</s>");
 	i1 = SearchVocab(1, (char *) "</s>"); // i1为什么是-1？
@@ -498,10 +1414,23 @@ void LoadLexicon() {
 	fclose(fin1);
 }
 
+/* Returns the index of a sememe with the given GetWordHash() hash, or -1 */
+int SearchSememe(char *word, unsigned int hash) {
+	long long pos = hash & sememe_hash_mask;
+	while (sememe_hash[pos].idx != -1) {
+		if (sememe_hash[pos].hash == hash
+		        && !strcmp(word, sememe_arena.data + sememes[sememe_hash[pos].idx].word))
+			return sememe_hash[pos].idx;
+		pos = (pos + 1) & sememe_hash_mask;
+	}
+	return -1;
+}
+
 void ReadSememes() {
 	FILE * fin;
 	char word[MAX_STRING];
-	unsigned int length;
+	unsigned int hash;
+	long long a, pos, slots = 1024;
 	fin = fopen(sememe_file, "rb");
 	if (fin == NULL) {
 		printf("ERROR: sememe file not found!\n");
@@ -511,70 +1440,113 @@ void ReadSememes() {
 		ReadWordNoEOL(word, fin);
 		if (feof(fin))
 			break;
-		length = strlen(word) + 1;
-		sememes[sememe_size].word = calloc(length, sizeof(char));
-		strcpy(sememes[sememe_size].word, word);
+		if (sememe_size >= MAX_SEMEME_SIZE) {
+			printf("ERROR: more than %d sememes in %s!\n", MAX_SEMEME_SIZE, sememe_file);
+			exit(1);
+		}
+		sememes[sememe_size].word = ArenaAdd(&sememe_arena, word);
 		sememe_size++;
 	}
+	fclose(fin);
+
+	// 义原哈希表，重复的义原保留第一个
+	while (slots < sememe_size * 2)
+		slots *= 2;
+	sememe_hash = malloc(slots * sizeof(struct vocab_hash_slot));
+	sememe_hash_mask = slots - 1;
+	for (pos = 0; pos < slots; pos++)
+		sememe_hash[pos].idx = -1;
+	for (a = 0; a < sememe_size; a++) {
+		hash = GetWordHash(sememe_arena.data + sememes[a].word);
+		if (SearchSememe(sememe_arena.data + sememes[a].word, hash) != -1)
+			continue;
+		pos = hash & sememe_hash_mask;
+		while (sememe_hash[pos].idx != -1)
+			pos = (pos + 1) & sememe_hash_mask;
+		sememe_hash[pos].idx = a;
+		sememe_hash[pos].hash = hash;
+	}
 	return;
 }
+
+/* Loads the HowNet dictionary: one word per line, followed by its sememes.
+ * The file is mapped and scanned with @ReadWordMem, sememes are looked up
+ * through @SearchSememe and the sememe lists of all words are stored in
+ * hownet_offsets/hownet_sememes. Sememes that are not in the sememe list are
+ * skipped */
 void ReadHowNet() {
-	FILE * fin;
-	int sememe_num, sememe_tmp[30], a;
-	char word[MAX_STRING];
-	unsigned int hash, length;
+	struct stat st;
+	char word[MAX_STRING], *data = NULL, *pos, *end;
+	unsigned int hash;
+	long long a, num_sememes = 0, capacity = 1 << 16;
+	char eof;
+	int fd = open(hownet_file, O_RDONLY);
 
-	fin = fopen(hownet_file, "rb");
-	if (fin == NULL) {
+	if (fd < 0 || fstat(fd, &st) < 0) {
 		printf("ERROR: hownet file not found!\n");
 		exit(1);
 	}
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			printf("ERROR: cannot map hownet file (%s)!\n", hownet_file);
+			exit(1);
+		}
+	}
+	close(fd);
+	pos = data;
+	end = data + st.st_size;
 
 	for (a = 0; a < HOWNET_HASH_SIZE; a++)
 		hownet_hash[a] = -1;
 	hownet_size = 0;
-
+	hownet_offsets = malloc((MAX_HOWNET_SIZE + 1) * sizeof(long long));
+	hownet_sememes = malloc(capacity * sizeof(int));
+	hownet_offsets[0] = 0;
 
 	while (1) {
-		ReadWordNoEOL(word, fin); // 读词
-		if (feof(fin))
+		// 读词，跳过空行
+		while (!(eof = ReadWordMem(word, &hash, &pos, end)) && !strcmp(word, (char *)"</s>"));
+		if (eof)
 			break;
-		printf("Add word of HowNet: %s\n", word);
-
-		length = strlen(word) + 1;
-		hownet[hownet_size].word = calloc(length, sizeof(char));
-		strcpy(hownet[hownet_size].word, word);
+		if (hownet_size >= MAX_HOWNET_SIZE) {
+			printf("ERROR: more than %d words in %s!\n", MAX_HOWNET_SIZE, hownet_file);
+			exit(1);
+		}
+		hownet[hownet_size].word = ArenaAdd(&sememe_arena, word);
 
 		// 记录哈希值
-		hash = GetHowNetHash(word);
-		while (hownet_hash[hash] != -1)
-			hash = (hash + 1) % HOWNET_HASH_SIZE;
-		hownet_hash[hash] = hownet_size;
+		a = GetHowNetHash(word);
+		while (hownet_hash[a] != -1)
+			a = (a + 1) % HOWNET_HASH_SIZE;
+		hownet_hash[a] = hownet_size;
 
 		// 读取义原
-		sememe_num = 0;
 		while (1) {
-			ReadWord(word, fin); // 注意这里word每次都会改变
-			if (feof(fin)) // 读取到eof
+			if (ReadWordMem(word, &hash, &pos, end)) // 读取到eof
 				break;
-
 			if (!strcmp(word, (char *)"</s>")) // 读取到行尾
 				break;
-			printf("\tAdd sememe: %s\n", word);
-
-			for (a = 0; a < sememe_size; a++) // 遍历各个义原
-				if (!strcmp(word, sememes[a].word)) {
-					sememe_tmp[sememe_num++] = a;
-					break;
+			a = SearchSememe(word, hash);
+			if (a == -1)
+				continue;
+			if (num_sememes >= capacity) {
+				capacity *= 2;
+				hownet_sememes = realloc(hownet_sememes, capacity * sizeof(int));
+				if (hownet_sememes == NULL) {
+					printf("Memory allocation failed\n");
+					exit(1);
 				}
+			}
+			hownet_sememes[num_sememes++] = a;
 		}
-		hownet[hownet_size].sememe_num = sememe_num;
-		hownet[hownet_size].sememe_idx = calloc(sememe_num, sizeof(int));
-		for (a = 0; a < sememe_num; a++)
-			hownet[hownet_size].sememe_idx[a] = sememe_tmp[a];
-
 		hownet_size++;
+		hownet_offsets[hownet_size] = num_sememes;
 	}
+	if (data != NULL)
+		munmap(data, st.st_size);
+	if (debug_mode > 0)
+		fprintf(stderr, "HowNet words: %d, sememes: %lld\n", hownet_size, num_sememes);
 	return;
 }
 void InitNetSememe() {
@@ -635,6 +1607,8 @@ void InitNetSememe() {
 		exit(1);
 	}
 
+	if (resume_file[0] != 0)
+		return;         // the parameters come from the checkpoint
 	// 初始化
 	for (a = 0; a < hownet_size; a++) {
 		word_bias[a] =  (rand() / (real) RAND_MAX - 0.5) / layer1_size;
@@ -652,107 +1626,681 @@ void InitNetSememe() {
 	} // rand()是否需要使用srand()？
 }
 
+/* Converts n bf16 values to reals */
+void Bf16ToReal(real *dst, const unsigned short *src, long long n) {
+	unsigned int *d = (unsigned int *) dst;
+	long long i;
+	for (i = 0; i < n; i++)
+		d[i] = (unsigned int) src[i] << 16;
+}
+
+/* Converts n reals to bf16 with stochastic rounding: a uniform offset is
+ * added below the 16 kept bits before truncating, so a value is rounded up
+ * with a probability proportional to its distance from the value below and
+ * small increments are not lost on average. The offsets are the
+ * upper bits of a per-thread Weyl sequence (multiples of the golden ratio),
+ * which is uniform and keeps the loop vectorizable. Infinities stay what
+ * they are, since their low bits are 0, and values within a bf16 step of
+ * FLT_MAX may round up to them. A NaN would carry into its exponent or
+ * sign, so it is truncated instead, with the quiet bit set so that no
+ * mantissa bits left makes it an infinity */
+__thread unsigned int round_step;
+
+void RealToBf16(unsigned short *dst, const real *src, long long n) {
+	const unsigned int *s = (const unsigned int *) src;
+	long long i;
+	for (i = 0; i < n; i++)
+		dst[i] = (s[i] & 0x7fffffff) > 0x7f800000 ? (s[i] >> 16) | 0x40
+		         : (s[i] + (((round_step + (unsigned int) i) * 2654435769u) >> 16)) >> 16;
+	round_step += n;
+}
+
+/* Bytes per AdaGrad accumulator */
+int GradSize() {
+	return grad_precision == PRECISION_BF16 ? sizeof(unsigned short) : sizeof(real);
+}
+
+/* Storage of syn0 (m == 0) or syn1neg (m == 1) of lang_id */
+void *ParamMatrix(int m, int lang_id) {
+	if (param_precision == PRECISION_BF16)
+		return (m ? syn1negh : syn0h)[lang_id];
+	return (m ? syn1negs : syn0s)[lang_id];
+}
+
+/* AdaGrad accumulators of the row of word in syn0 (m == 0) or syn1neg
+ * (m == 1) of lang_id, NULL without AdaGrad */
+static inline void *GradRow(int m, int lang_id, long long word) {
+	if (!adagrad)
+		return NULL;
+	return (char *) (m ? syn1negGrads : syn0grads)[lang_id] + word * layer1_size * GradSize();
+}
+
 void InitNet(int lang_id) {
 	long long a, b, vocab_size = vocab_sizes[lang_id];
-	real *syn0, *syn1neg, *syn0grad, *syn1negGrad;
+	long long grad_bytes = vocab_size * layer1_size * GradSize();
+	long long param_bytes = vocab_size * layer1_size
+	                        * (param_precision == PRECISION_BF16 ? sizeof(unsigned short) : sizeof(real));
+	void *syn0, *syn1neg;
+	void *syn0grad, *syn1negGrad;
+	real value;
 
 	// 分别为输入和输出向量开空间
-	a = posix_memalign((void **) &syn0, 128,
-	                   (long long) vocab_size * layer1_size * sizeof(real));
+	a = posix_memalign(&syn0, 128, param_bytes);
 	if (syn0 == NULL) {
 		printf("Memory allocation failed\n");
 		exit(1);
-	} else
-		syn0s[lang_id] = syn0;
-	a = posix_memalign((void **) &syn1neg, 128,
-	                   (long long) vocab_size * layer1_size * sizeof(real));
+	}
+	a = posix_memalign(&syn1neg, 128, param_bytes);
 	if (syn1neg == NULL) {
 		printf("Memory allocation failed\n");
 		exit(1);
-	} else
+	}
+	if (param_precision == PRECISION_BF16) {
+		syn0h[lang_id] = syn0;
+		syn1negh[lang_id] = syn1neg;
+	} else {
+		syn0s[lang_id] = syn0;
 		syn1negs[lang_id] = syn1neg;
+	}
 
 	// adagrad向量开空间
 	if (adagrad) {
-		a = posix_memalign((void **) &syn0grad, 128,
-		                   (long long) vocab_size * layer1_size * sizeof(real));
+		a = posix_memalign(&syn0grad, 128, grad_bytes);
 		if (syn0grad == NULL) {
 			printf("Memory allocation failed\n");
 			exit(1);
 		} else
 			syn0grads[lang_id] = syn0grad;
-		a = posix_memalign((void **) &syn1negGrad, 128,
-		                   (long long) vocab_size * layer1_size * sizeof(real));
+		a = posix_memalign(&syn1negGrad, 128, grad_bytes);
 		if (syn1negGrad == NULL) {
 			printf("Memory allocation failed\n");
 			exit(1);
 		} else
 			syn1negGrads[lang_id] = syn1negGrad;
 	}
+	if (resume_file[0] != 0)
+		return;         // the parameters come from the checkpoint
 	// 初始化
+	memset(syn1neg, 0, param_bytes); // 为什么这里用0初始化？
 	for (b = 0; b < layer1_size; b++) {
 		for (a = 0; a < vocab_size; a++) {
-			syn1neg[a * layer1_size + b] = 0; // 为什么这里用0初始化？
-			syn0[a * layer1_size + b] = (rand() / (real) RAND_MAX - 0.5) / layer1_size;
-
-			if (adagrad) {
-				syn0grad[a * layer1_size + b] = 0;
-				syn1negGrad[a * layer1_size + b] = 0;
-			}
+			value = (rand() / (real) RAND_MAX - 0.5) / layer1_size;
+			if (param_precision == PRECISION_BF16)
+				RealToBf16((unsigned short *) syn0 + a * layer1_size + b, &value, 1);
+			else
+				((real *) syn0)[a * layer1_size + b] = value;
 		}
 	}
+	if (adagrad) {
+		memset(syn0grad, 0, grad_bytes);        // 0 in both precisions
+		memset(syn1negGrad, 0, grad_bytes);
+	}
 }
 
-char SubSample(int lang_id, long long word_id) {
+/* Returns 1 when the word is dropped by subsampling, drawing from the random
+ * state *next_random of the calling task */
+char SubSample(int lang_id, long long word_id, unsigned long long *next_random) {
 	long long count = vocabs[lang_id][word_id].cn;
 	real thresh = (sqrt(count / (sample * train_words[lang_id])) + 1)
 	              * (sample * train_words[lang_id]) / count;
-	next_random = next_random * (unsigned long long) 25214903917 + 11;
-	if ((next_random & 0xFFFF) / (real) 65536 > thresh)
+	*next_random = *next_random * (unsigned long long) 25214903917 + 11;
+	if ((*next_random & 0xFFFF) / (real) 65536 > thresh)
 		return 1;
 	else
 		return 0;
 }
 
+/* Returns a 64-bit FNV-1a fingerprint of the words and counts of the
+ * vocabulary, used to check that a pre-tokenized corpus matches it */
+unsigned long long VocabFingerprint(int lang_id) {
+	long long a;
+	unsigned long long h = 14695981039346656037ULL;
+	char *p;
+	struct vocab_word *vocab = vocabs[lang_id];
+	for (a = 0; a < vocab_sizes[lang_id]; a++) {
+		for (p = VocabWord(lang_id, a); *p; p++)
+			h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+		h = (h ^ ' ') * 1099511628211ULL;
+		h = (h ^ (unsigned long long) vocab[a].cn) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Writes the training corpus of language lang_id as a stream of vocabulary
+ * ids to bin_train_files[lang_id]. Unknown words are dropped and every EOL
+ * becomes id 0, so that reading it back yields the same sentences as
+ * @ReadSent on the text file */
+void PreprocessTrainFile(int lang_id) {
+	struct token_file_header header;
+	int buf[4096], n = 0, word_id;
+	char word[MAX_STRING], *pos, *end;
+	unsigned int hash;
+	FILE *fo = fopen(bin_train_files[lang_id], "wb");
+
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s for writing!\n", bin_train_files[lang_id]);
+		exit(1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CLSPTOK", 8);
+	header.version = TOKEN_FILE_VERSION;
+	header.min_count = min_count;
+	header.vocab_hash = VocabFingerprint(lang_id);
+	header.vocab_size = vocab_sizes[lang_id];
+	fwrite(&header, sizeof(header), 1, fo);
+
+	MapTrainFile(lang_id);
+	pos = corpus_maps[lang_id];
+	end = pos + file_sizes[lang_id];
+	while (!ReadWordMem(word, &hash, &pos, end)) {
+		word_id = SearchVocabHash(lang_id, word, hash);
+		if (word_id == -1)
+			continue;
+		if (word_id == 0)
+			header.num_sents++;
+		buf[n++] = word_id;
+		if (n == 4096) {
+			fwrite(buf, sizeof(int), n, fo);
+			header.num_tokens += n;
+			n = 0;
+		}
+	}
+	fwrite(buf, sizeof(int), n, fo);
+	header.num_tokens += n;
+	UnmapTrainFile(lang_id);
+
+	fseek(fo, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, fo);
+	fclose(fo);
+	fprintf(stderr, "Wrote %lld tokens (%lld sentences) to %s\n",
+	        header.num_tokens, header.num_sents, bin_train_files[lang_id]);
+}
+
+/* Maps the pre-tokenized corpus of language lang_id and checks that it was
+ * produced with the current vocabulary */
+void MapTokenFile(int lang_id) {
+	struct stat st;
+	struct token_file_header *header;
+	char *bin_file = bin_train_files[lang_id];
+	int fd = open(bin_file, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("ERROR: pre-tokenized data file (%s) not found!\n", bin_file);
+		exit(1);
+	}
+	if (st.st_size < (long long) sizeof(struct token_file_header)) {
+		printf("ERROR: %s is not a pre-tokenized corpus!\n", bin_file);
+		exit(1);
+	}
+	token_maps[lang_id] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (token_maps[lang_id] == MAP_FAILED) {
+		printf("ERROR: cannot map pre-tokenized data file (%s)!\n", bin_file);
+		exit(1);
+	}
+	header = (struct token_file_header *) token_maps[lang_id];
+	if (memcmp(header->magic, "CLSPTOK", 8) || header->version != TOKEN_FILE_VERSION
+	        || st.st_size != (long long) sizeof(*header) + header->num_tokens * (long long) sizeof(int)) {
+		printf("ERROR: %s is not a pre-tokenized corpus!\n", bin_file);
+		exit(1);
+	}
+	if (header->min_count != min_count || header->vocab_size != vocab_sizes[lang_id]
+	        || header->vocab_hash != VocabFingerprint(lang_id)) {
+		printf("ERROR: %s was preprocessed with a different vocabulary "
+		       "(min-count %d, %lld words)!\n", bin_file, header->min_count,
+		       header->vocab_size);
+		exit(1);
+	}
+	madvise(token_maps[lang_id], st.st_size, MADV_SEQUENTIAL);
+	corpus_tokens[lang_id] = (int *) (header + 1);
+	token_counts[lang_id] = header->num_tokens;
+}
+
+void UnmapTokenFile(int lang_id) {
+	munmap(token_maps[lang_id], sizeof(struct token_file_header)
+	       + token_counts[lang_id] * sizeof(int));
+	token_maps[lang_id] = NULL;
+	corpus_tokens[lang_id] = NULL;
+}
+
+/* Indexes the corpus of language lang_id: the sentence starts (byte offsets
+ * in the text or token offsets in a -bin-trainN corpus) where a new block of
+ * at least SENT_INDEX_BLOCK tokens begins, and the word after every
+ * MAX_SEN_LEN tokens of a sentence. Tokens are split like @ReadWordMem,
+ * counting every EOL as one. Returns the number of entries */
+long long BuildSentIndex(int lang_id, struct sent_index_entry **entries, long long *num_tokens) {
+	long long n = 0, max_n = 1024, size, i, tokens = 0, sen_tokens = 0;
+	char *text = NULL, in_word = 0, mapped = 0, cut;
+
+	*entries = malloc(max_n * sizeof(struct sent_index_entry));
+	(*entries)[0].offset = 0;
+	*num_tokens = 0;
+	if (corpus_tokens[lang_id] != NULL)
+		size = token_counts[lang_id];
+	else {
+		if (corpus_maps[lang_id] == NULL) {
+			MapTrainFile(lang_id);
+			mapped = 1;
+		}
+		text = corpus_maps[lang_id];
+		size = file_sizes[lang_id];
+	}
+	for (i = 0; i < size; i++) {
+		if (text == NULL) {
+			tokens++;
+			sen_tokens++;
+		} else if (text[i] == ' ' || text[i] == '\t' || text[i] == '\n') {
+			tokens += in_word + (text[i] == '\n');
+			sen_tokens += in_word;
+			in_word = 0;
+		} else if (text[i] != 13)
+			in_word = 1;
+		if (text == NULL ? corpus_tokens[lang_id][i] == 0 : text[i] == '\n') {
+			cut = tokens >= SENT_INDEX_BLOCK;
+			sen_tokens = 0;
+		} else {
+			// a word ends here and the sentence has MAX_SEN_LEN more tokens
+			cut = sen_tokens == MAX_SEN_LEN && (text == NULL || !in_word);
+			if (cut)
+				sen_tokens = 0;
+		}
+		if (cut) {
+			(*entries)[n].tokens = tokens;
+			*num_tokens += tokens;
+			tokens = 0;
+			if (++n == max_n) {
+				max_n *= 2;
+				*entries = realloc(*entries, max_n * sizeof(struct sent_index_entry));
+			}
+			(*entries)[n].offset = i + 1;
+		}
+	}
+	tokens += in_word;
+	if (tokens > 0) {
+		(*entries)[n++].tokens = tokens;
+		*num_tokens += tokens;
+	}
+	if (mapped)
+		UnmapTrainFile(lang_id);
+	return n;
+}
+
+/* Loads the sentence index of the text corpus of language lang_id from
+ * <corpus>.idx, or builds and saves it if it is missing or older than the
+ * corpus. A -bin-trainN corpus is indexed in memory. Returns the number of
+ * entries */
+long long LoadSentIndex(int lang_id, struct sent_index_entry **entries) {
+	char index_file[MAX_STRING + 8];
+	struct sent_index_header header;
+	struct stat st;
+	long long n, num_tokens;
+	FILE *f;
+
+	if (corpus_tokens[lang_id] != NULL)
+		return BuildSentIndex(lang_id, entries, &num_tokens);
+	if (stat(mono_train_files[lang_id], &st) < 0) {
+		printf("ERROR: training data file (%s) not found!\n", mono_train_files[lang_id]);
+		exit(1);
+	}
+	file_sizes[lang_id] = st.st_size;
+	sprintf(index_file, "%s.idx", mono_train_files[lang_id]);
+	f = fopen(index_file, "rb");
+	if (f != NULL) {
+		if (fread(&header, sizeof(header), 1, f) == 1 && !memcmp(header.magic, "CLSPIDX", 8)
+		        && header.version == SENT_INDEX_VERSION && header.block == SENT_INDEX_BLOCK
+		        && header.file_size == st.st_size && header.mtime == st.st_mtime) {
+			*entries = malloc((header.num_entries + 1) * sizeof(struct sent_index_entry));
+			if (fread(*entries, sizeof(struct sent_index_entry), header.num_entries, f)
+			        == header.num_entries) {
+				fclose(f);
+				return header.num_entries;
+			}
+			free(*entries);
+		}
+		fclose(f);
+	}
+
+	fprintf(stderr, "Indexing sentences of %s\n", mono_train_files[lang_id]);
+	n = BuildSentIndex(lang_id, entries, &num_tokens);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CLSPIDX", 8);
+	header.version = SENT_INDEX_VERSION;
+	header.block = SENT_INDEX_BLOCK;
+	header.file_size = st.st_size;
+	header.mtime = st.st_mtime;
+	header.num_entries = n;
+	header.num_tokens = num_tokens;
+	f = fopen(index_file, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "WARNING: cannot write %s, the index is rebuilt every run\n", index_file);
+		return n;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(*entries, sizeof(struct sent_index_entry), n, f);
+	fclose(f);
+	return n;
+}
+
+/* Cuts entries [lo, hi) of a sentence index into parts runs of about equal
+ * token counts, run s being [cuts[s], cuts[s + 1]): every cut is put at the
+ * entry boundary closest to its share, keeping at least one entry in every
+ * run. Needs hi - lo >= parts */
+void CutEntries(struct sent_index_entry *entries, long long lo, long long hi, int parts,
+                long long *cuts) {
+	long long total = 0, sum = 0, i;
+	int s;
+
+	for (i = lo; i < hi; i++)
+		total += entries[i].tokens;
+	cuts[0] = lo;
+	for (s = 1, i = lo; s < parts; s++) {
+		// sum is the number of tokens in [lo, i)
+		while (i < hi - (parts - s) && (i == cuts[s - 1]
+		                                || llabs((sum + entries[i].tokens) * parts - total * s)
+		                                <= llabs(sum * parts - total * s)))
+			sum += entries[i++].tokens;
+		cuts[s] = i;
+	}
+	cuts[parts] = hi;
+}
+
+/* Splits the corpus of language lang_id into equal token counts on the
+ * entries of its sentence index: first into one part per mono task, then
+ * each part into up to SHARDS_PER_TASK shards of at least one entry. Small
+ * corpora with fewer entries than tasks are not sharded */
+void InitShards(int lang_id) {
+	struct sent_index_entry *entries;
+	long long n = LoadSentIndex(lang_id, &entries), size;
+	long long *tasks = malloc((num_threads + 1) * sizeof(long long)), cuts[SHARDS_PER_TASK + 1];
+	int shards = 0, parts, a, s;
+
+	if (n >= num_threads) {
+		size = corpus_tokens[lang_id] != NULL ? token_counts[lang_id] : file_sizes[lang_id];
+		shard_starts[lang_id] = malloc((num_threads * SHARDS_PER_TASK + 1) * sizeof(long long));
+		task_shards[lang_id] = malloc((num_threads + 1) * sizeof(int));
+		CutEntries(entries, 0, n, num_threads, tasks);
+		for (a = 0; a < num_threads; a++) {
+			task_shards[lang_id][a] = shards;
+			parts = tasks[a + 1] - tasks[a] < SHARDS_PER_TASK ? tasks[a + 1] - tasks[a] : SHARDS_PER_TASK;
+			CutEntries(entries, tasks[a], tasks[a + 1], parts, cuts);
+			for (s = 0; s < parts; s++)
+				shard_starts[lang_id][shards++] = entries[cuts[s]].offset;
+		}
+		task_shards[lang_id][num_threads] = shards;
+		shard_starts[lang_id][shards] = size;
+		shard_counts[lang_id] = shards;
+		shard_orders[lang_id] = malloc(shards * sizeof(int));
+		for (s = 0; s < shards; s++)
+			shard_orders[lang_id][s] = s;
+	}
+	free(tasks);
+	free(entries);
+}
+
+/* Position of one training thread in a monolingual corpus. A pre-tokenized
+ * corpus is walked id by id; with -mmap the thread scans its part of the
+ * mapped text file directly, otherwise it reads through its own stdio
+ * stream */
+struct corpus_reader {
+	int lang_id;
+	long long start;	// byte (or token) offset the thread (re)starts from
+	FILE *fi;
+	char *pos, *end;
+	int *tok, *tok_end;
+	char eof;
+	int *shards, num_shards, shard;	// with -sent-index: the shards to read, in order
+	long long shard_end;
+};
+
+/* Current offset of the reader, in bytes or tokens */
+long long ReaderOffset(struct corpus_reader *r) {
+	if (r->fi != NULL)
+		return ftell(r->fi);
+	if (r->tok != NULL)
+		return r->tok - corpus_tokens[r->lang_id];
+	return r->pos - corpus_maps[r->lang_id];
+}
+
+/* Moves the reader to the beginning of its shard-th shard */
+void SeekShard(struct corpus_reader *r, int shard) {
+	long long *starts = shard_starts[r->lang_id], offset;
+
+	r->shard = shard;
+	offset = starts[r->shards[shard]];
+	r->shard_end = starts[r->shards[shard] + 1];
+	r->eof = 0;
+	if (r->fi != NULL)
+		fseek(r->fi, offset, SEEK_SET);
+	else if (corpus_tokens[r->lang_id] != NULL) {
+		r->tok_end = corpus_tokens[r->lang_id] + token_counts[r->lang_id];
+		r->tok = corpus_tokens[r->lang_id] + offset;
+	} else {
+		r->end = corpus_maps[r->lang_id] + file_sizes[r->lang_id];
+		r->pos = corpus_maps[r->lang_id] + offset;
+	}
+}
+
+void OpenReader(struct corpus_reader *r, int lang_id, int thread_id) {
+	r->lang_id = lang_id;
+	r->start = file_sizes[lang_id] / (long long) num_threads * thread_id;
+	r->fi = NULL;
+	r->pos = r->end = NULL;
+	r->tok = r->tok_end = NULL;
+	r->shards = NULL;
+	if (shard_orders[lang_id] != NULL) {
+		r->shards = shard_orders[lang_id] + task_shards[lang_id][thread_id];
+		r->num_shards = task_shards[lang_id][thread_id + 1] - task_shards[lang_id][thread_id];
+	}
+	if (corpus_tokens[lang_id] != NULL)
+		r->start = token_counts[lang_id] / num_threads * thread_id;
+	else if (!use_mmap) {
+		r->fi = fopen(mono_train_files[lang_id], "rb");
+		if (r->fi == NULL) {
+			printf("ERROR: training data file (%s) not found!\n",
+			       mono_train_files[lang_id]);
+			exit(1);
+		}
+	}
+}
+
+/* Moves the reader back to the beginning of its part of the corpus */
+void ResetReader(struct corpus_reader *r) {
+	r->eof = 0;
+	if (r->shards != NULL) {
+		SeekShard(r, 0);
+		return;
+	}
+	if (r->fi != NULL) {
+		fseek(r->fi, r->start, SEEK_SET);
+		return;
+	}
+	if (corpus_tokens[r->lang_id] != NULL) {
+		r->tok_end = corpus_tokens[r->lang_id] + token_counts[r->lang_id];
+		r->tok = corpus_tokens[r->lang_id] + r->start;
+		return;
+	}
+	r->end = corpus_maps[r->lang_id] + file_sizes[r->lang_id];
+	r->pos = corpus_maps[r->lang_id] + r->start;
+}
+
+/* Moves the reader to offset (see @ReaderOffset) in its shard-th shard, or
+ * in its part of the corpus without shards */
+void SeekReader(struct corpus_reader *r, int shard, long long offset) {
+	if (r->shards != NULL)
+		SeekShard(r, shard);
+	else
+		ResetReader(r);
+	if (r->fi != NULL)
+		fseek(r->fi, offset, SEEK_SET);
+	else if (r->tok != NULL)
+		r->tok = corpus_tokens[r->lang_id] + offset;
+	else
+		r->pos = corpus_maps[r->lang_id] + offset;
+}
+
+void CloseReader(struct corpus_reader *r) {
+	if (r->fi != NULL)
+		fclose(r->fi);
+	r->fi = NULL;
+}
+
+// -readers: reader threads tokenize and subsample the corpus ahead of the
+// mono tasks. Each mono task gets a ring of RING_SLOTS batches with a single
+// producer (its reader thread) and a single consumer (whichever worker runs
+// the task), so head and tail need no lock; a batch holds whole sentences,
+// each followed by 0 (</s>), see FillRing and PopSent
+#define RING_SLOTS 8
+#define RING_BATCH 4096		// token ids per batch
+struct sent_batch {
+	int n;				// ids used
+	char pass_end;			// the reader started its part over after these sentences
+	int ids[RING_BATCH];
+};
+struct sent_ring {
+	long long head __attribute__((aligned(64)));	// batches pushed, written by the reader only
+	long long tail __attribute__((aligned(64)));	// batches popped, written by the trainer only
+	long long pos;			// next id of batch tail
+	long long occupancy, pops, empty_waits;	// trainer side statistics of the epoch
+	struct sent_batch *batches __attribute__((aligned(64)));
+	long long read_words, full_waits;	// reader side: words of the pass, times the ring was full
+	unsigned long long read_random;	// subsampling of the reader
+};
+int prefetch_readers = 0;
+
+// State of the training objectives between two steps of the worker pool.
+// A mono_task trains one language on one part of its corpus and is done at
+// the end of the epoch; the lexicon, sememe and matching objectives cycle
+// over their part of the lexicon or vocabulary in an aux_task until all
+// mono_tasks are done
+struct mono_task {
+	int lang_id, thread_id;
+	long long word_count, last_word_count, sentence_length, sentence_position;
+	unsigned long long next_random;	// windows, subsampling and negatives
+	int mono_sen[MAX_SEN_LEN + 1];
+	real *neu1, *neu1e, *syn1negDelta;
+	real *row_bufs;			// -param-precision bf16: rows being updated, see @MonoRow
+	long long *batch_words;		// -hogbatch: context words, then targets
+	real *batch_g, *batch_e;	// and their gradients
+	unsigned int *in_word;		// -fused-aux: sememes of the current word
+	long long hot_n, hot_words;	// -hot-rows: rows replicated, words since the last merge
+	real *hot[2], *hot_base[2];	// replicas of syn0 and syn1neg, and their values at the last merge
+	real *hot_grads[2], *hot_grads_base[2];	// the same for the AdaGrad accumulators
+	struct corpus_reader reader;	// owned by the reader thread with -readers
+	struct sent_ring ring;		// -readers: prefetched sentences
+};
+struct aux_task {
+	int thread_id;
+	int lang_id;			// query language of matching
+	long long entry;		// next lexicon entry or word
+	unsigned long long next_random;	// sememe negatives
+	unsigned int *in_word;		// sememes of the current word
+	real *q;			// matching queries
+};
+
+/* Reads a word through @r and returns its index in the vocabulary */
+int ReaderWordIndex(struct corpus_reader *r) {
+	char word[MAX_STRING];
+	unsigned int hash;
+	int word_id;
+	if (r->fi != NULL) {
+		word_id = ReadWordIndex(r->fi, r->lang_id);
+		r->eof = feof(r->fi) != 0;
+		return word_id;
+	}
+	r->eof = ReadWordMem(word, &hash, &r->pos, r->end);
+	if (r->eof)
+		return -1;
+	return SearchVocabHash(r->lang_id, word, hash);
+}
+
 /* Read a sentence into *sen using vocabulary for language lang_id
 * Store processed words in *sen, returns (potentially subsampled)
-* length of sentence */
-int ReadSent(FILE * fi, int lang_id, long long * sen, char subsample) {
-	long long word;
-	int sentence_length = 0;
+* length of sentence. Subsampling draws from *next_random, NULL disables it */
+int ReadSent(struct corpus_reader *r, int * sen, unsigned long long *next_random) {
+	int word, sentence_length = 0, lang_id = r->lang_id;
 	//struct vocab_word *vocab = vocabs[lang_id];
+	while (r->shards != NULL && ReaderOffset(r) >= r->shard_end) {
+		if (r->shard + 1 == r->num_shards) {
+			r->eof = 1;
+			return 0;
+		}
+		SeekShard(r, r->shard + 1);
+	}
 	while (1) {
-		word = ReadWordIndex(fi, lang_id);
-		if (feof(fi))
-			break;
-		if (word == -1)
-			continue;       // unknown
+		if (r->tok != NULL) { // pre-tokenized, no string work at all
+			if (r->tok >= r->tok_end) {
+				r->eof = 1;
+				break;
+			}
+			word = *r->tok++;
+		} else {
+			word = ReaderWordIndex(r);
+			if (r->eof)
+				break;
+		}
 		if (word == 0)
 			break;           // 换行符\n，表示 end-of-sentence
-		// The subsampling randomly discards frequent words while keeping the
-		// ranking the same.
-		if (subsample && sample > 0) { // sample由输入设置，推荐值为1e-5
-			if (SubSample(lang_id, word)) // 若降采样成功，则跳过该词
-				continue;
+		// Unknown words are skipped. The subsampling randomly discards
+		// frequent words while keeping the ranking the same. sample由输入设置，
+		// 推荐值为1e-5，若降采样成功，则跳过该词
+		if (word != -1 && (next_random == NULL || sample <= 0 || !SubSample(lang_id, word, next_random))) {
+			sen[sentence_length] = word;
+			sentence_length++;
+			if (sentence_length >= MAX_SEN_LEN)
+				break;
 		}
-		sen[sentence_length] = word;
-		sentence_length++;
-		if (sentence_length >= MAX_SEN_LEN)
-			break;
+		if (r->shards != NULL && ReaderOffset(r) >= r->shard_end)
+			break;  // the shard ends inside a long sentence
 	}
+	// the shard at the end of the corpus is not the last one of the reader
+	if (r->eof && r->shards != NULL && r->shard + 1 < r->num_shards)
+		SeekShard(r, r->shard + 1);
 	return sentence_length;
 }
 
+// Kernels of the innermost loops: dot products of two rows and the SGD /
+// AdaGrad update of a row. Every kernel has a scalar reference version and,
+// on x86, AVX2 + FMA and AVX-512 versions; @SelectSimdKernels picks the
+// widest one the CPU supports (or -simd) once at startup and checks it
+// against the scalar version before training
+struct simd_kernels {
+	const char *name;
+	real (*dot)(const real *a, const real *b, int n);
+	real (*add_dot)(const real *a, const real *c, const real *b, const real *d, int n);	// (a + c) . (b + d)
+	void (*update)(real *embeddings, real *grads, int n, const real *deltas, real weight);
+	void (*update_bf16)(real *embeddings, unsigned short *grads, int n, const real *deltas, real weight);	// AdaGrad only
+	int (*dot_int8)(const signed char *a, const signed char *b, int n);
+	void (*from_bf16)(real *dst, const unsigned short *src, long long n);
+	void (*to_bf16)(unsigned short *dst, const real *src, long long n);	// see @RealToBf16
+};
+struct simd_kernels simd;
+char simd_name[MAX_STRING] = "auto";
+
+real DotScalar(const real *a, const real *b, int n) {
+	real result = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		result += a[i] * b[i];
+	return result;
+}
+
+real AddDotScalar(const real *a, const real *c, const real *b, const real *d, int n) {
+	real result = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		result += (a[i] + c[i]) * (b[i] + d[i]);
+	return result;
+}
+
 //Zm: @grads is only used for AdaGrad
-void UpdateEmbeddings(real * embeddings, real * grads, int offset,
-                      int num_updates, real * deltas, real weight) {
+void UpdateScalar(real *embeddings, real *grads, int n, const real *deltas, real weight) {
 	int a;
 	real step, epsilon = 1e-6;
-	for (a = 0; a < num_updates; a++) {
+	for (a = 0; a < n; a++) {
 		if (adagrad) {
 			// Use Adagrad for automatic learning rate selection
-			grads[offset + a] += (deltas[a] * deltas[a]);
-			step = (alpha / fmax(epsilon, sqrt(grads[offset + a]))) * deltas[a];
+			grads[a] += (deltas[a] * deltas[a]);
+			step = (alpha / fmax(epsilon, sqrt(grads[a]))) * deltas[a];
 		} else {
 			// Regular SGD
 			step = alpha * deltas[a];
@@ -767,407 +2315,1948 @@ void UpdateEmbeddings(real * embeddings, real * grads, int offset,
 			if (step < -CLIP_UPDATES)
 				step = -CLIP_UPDATES;
 		}
-		embeddings[offset + a] += step;
+		embeddings[a] += step;
 	}
 }
 
-void LexiconUpdate(long long w_I, long long w_O, int lang_id1, int lang_id2, // w_I,w_O表示词典的一对词，
-                   real lambda, real * delta) {
-	long long l1, l2;
-	int c;
-	l1 = w_I * layer1_size;
-	l2 = w_O * layer1_size;
-	//update input vector
-	for (c = 0; c < layer1_size; c++) {
-		delta[c] = syn0s[lang_id1][c + l1] - syn0s[lang_id2][c + l2];
-	}
-	UpdateEmbeddings(syn0s[lang_id1], syn0grads[lang_id1], l1,
-	                 layer1_size, delta, -lambda);
-	UpdateEmbeddings(syn0s[lang_id2], syn0grads[lang_id2], l2,
-	                 layer1_size, delta, lambda);
-	//update output vector
-	for (c = 0; c < layer1_size; c++) {
-		delta[c] = syn1negs[lang_id1][c + l1] - syn1negs[lang_id2][c + l2];
-	}
-	UpdateEmbeddings(syn1negs[lang_id1], syn1negGrads[lang_id1], l1,
-	                 layer1_size, delta, -lambda);
-	UpdateEmbeddings(syn1negs[lang_id2], syn1negGrads[lang_id2], l2,
-	                 layer1_size, delta, lambda);
+int DotInt8Scalar(const signed char *a, const signed char *b, int n) {
+	int result = 0, i;
+	for (i = 0; i < n; i++)
+		result += a[i] * b[i];
+	return result;
 }
 
-void MatchUpdate(long long w_I, long long w_O, int lang_id1, int lang_id2,
-                 real lambda, real * delta) {
-	long long l1, l2;
-	int c;
-	l1 = w_I * layer1_size;
-	l2 = w_O * layer1_size;
-
-	for (c = 0; c < layer1_size; c++) {
-		delta[c] = syn0s[lang_id1][c + l1] + syn1negs[lang_id1][c + l1] - syn0s[lang_id2][c + l2] - syn1negs[lang_id2][c + l2];
-	} // 这个为什么不像Lexicon Update一样对两套词向量分别计算delta来更新？是因为这个matching是根据平均词向量最相近求出来的？
-
-	//update input vector
-	UpdateEmbeddings(syn0s[lang_id1], syn0grads[lang_id1], l1,
-	                 layer1_size, delta, -lambda);
-	UpdateEmbeddings(syn0s[lang_id2], syn0grads[lang_id2], l2,
-	                 layer1_size, delta, lambda);
-	//update output vector
-	UpdateEmbeddings(syn1negs[lang_id1], syn1negGrads[lang_id1], l1,
-	                 layer1_size, delta, -lambda);
-	UpdateEmbeddings(syn1negs[lang_id2], syn1negGrads[lang_id2], l2,
-	                 layer1_size, delta, lambda);
-}
-
-void *LexiconThread(void *id) {
-	char LOCAL_ALL_MONO_DONE;
-	int thread_id = (int) id % num_threads; // 没有必要，直接令thread_id=id即可
-	long long entry;	//entry in the lexicon
-	real deltas1[layer1_size], deltas2[layer1_size];
-
-	entry = lexicon_size / num_threads * thread_id; // 各个线程读词表的起始位置
-
-	// Continue training while monolingual models are still training
-	while (1) { //MONO_DONE_TRAINING < NUM_LANG * num_threads) {
-		pthread_rwlock_rdlock(&lock);
-		LOCAL_ALL_MONO_DONE = ALL_MONO_DONE;
-		pthread_rwlock_unlock(&lock);
-		if (LOCAL_ALL_MONO_DONE) break; // 如果单语线程已经结束，那么退出；否则一直训练
-		if (entry >= lexicon_size / num_threads * (thread_id + 1)) { // 读到了该线程对应词表的末位，则返回起始位置
-			entry = lexicon_size / num_threads * thread_id;
-			continue;
-		}
-		LexiconUpdate(lexicons[0][entry], lexicons[1][entry], 0, 1, LEXICON_LAMBDA, deltas1);
-		//LexiconUpdate(lexicons[1][entry], lexicons[0][entry], 1, 0, LEXICON_LAMBDA, deltas1, deltas2);
-		entry++;
-	} // while training loop
-	//	fprintf(stderr, "Exiting lexicon thread %d. ALL_MONO_DONE = %d\n", (int)id, ALL_MONO_DONE);
-	pthread_exit(NULL);
-	return NULL;
+/* AdaGrad update of a row whose accumulators are stored in bf16 */
+void UpdateBf16Scalar(real *embeddings, unsigned short *grads, int n, const real *deltas, real weight) {
+	real row[n];
+	Bf16ToReal(row, grads, n);
+	UpdateScalar(embeddings, row, n, deltas, weight);
+	RealToBf16(grads, row, n);
 }
-// 从HowNet中找当前词表中的词
 
-int SearchHowNet(long long entry) {
-	char * word = vocabs[1][entry].word;
-	unsigned int hash = GetHowNetHash(word);
-	while (1) {
-		if (hownet_hash[hash] == -1)
-			return -1;
-		if (!strcmp(word, hownet[hownet_hash[hash]].word))
-			return hownet_hash[hash];
-		hash = (hash + 1) % HOWNET_HASH_SIZE;
-	}
-	return -1;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static inline real HorizontalSum256(__m256 v) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
 }
-real ClipStep(real step) {
-	if (CLIP_UPDATES > 0) {
-		if (step > CLIP_UPDATES)
-			return CLIP_UPDATES;
-		if (step < -CLIP_UPDATES)
-			return -CLIP_UPDATES;
+
+__attribute__((target("avx2,fma")))
+real DotAvx2(const real *a, const real *b, int n) {
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	real result;
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
 	}
-	return step;
+	for (; i + 8 <= n; i += 8)
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+	result = HorizontalSum256(_mm256_add_ps(s0, s1));
+	for (; i < n; i++)
+		result += a[i] * b[i];
+	return result;
 }
 
-void *SememeThread(void *id) {
-	char LOCAL_ALL_MONO_DONE;
-	int thread_id = (int) id;
-	int hownet_idx, a, b, c, sememe_in_word;
-	long long zh_entry, l0, l1, zh_vocab_size = vocab_sizes[1];
-	real * syn0 = syn0s[1], *syn1neg = syn1negs[1], delta, sememe_grad, word_grad;
+__attribute__((target("avx2,fma")))
+real AddDotAvx2(const real *a, const real *c, const real *b, const real *d, int n) {
+	__m256 s = _mm256_setzero_ps();
+	real result;
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+		s = _mm256_fmadd_ps(_mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(c + i)),
+		                    _mm256_add_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(d + i)), s);
+	result = HorizontalSum256(s);
+	for (; i < n; i++)
+		result += (a[i] + c[i]) * (b[i] + d[i]);
+	return result;
+}
 
-	zh_entry = zh_vocab_size / num_threads * thread_id;
-	while (1) {
-		pthread_rwlock_rdlock(&lock);
-		LOCAL_ALL_MONO_DONE = ALL_MONO_DONE;
-		pthread_rwlock_unlock(&lock);
-		if (LOCAL_ALL_MONO_DONE) break;  // 如果单语线程已经结束，那么退出；否则一直训练
+/* 1 / max(epsilon, sqrt(g)): rsqrt refined by one Newton step, clipped at
+ * 1 / epsilon; min returns its second operand for the NaN of rsqrt(0) * 0,
+ * like fmax(epsilon, sqrt(0)) does in @UpdateScalar */
+__attribute__((target("avx2,fma")))
+static inline __m256 AdaGradScale256(__m256 g) {
+	__m256 r = _mm256_rsqrt_ps(g);
+	r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_set1_ps(0.5), g), _mm256_mul_ps(r, r),
+	                                      _mm256_set1_ps(1.5)));
+	return _mm256_min_ps(r, _mm256_set1_ps(1e6));
+}
 
-		if (zh_entry >= zh_vocab_size / num_threads * (thread_id + 1)) { // 读到了该线程对应词表的末位，则返回起始位置
-			zh_entry = zh_vocab_size / num_threads * thread_id;
-			continue;
-		}
-		hownet_idx = SearchHowNet(zh_entry);// 给定一个词在当前词表中的index，返回该词在hownet词典中的index
-		if (hownet_idx == -1) {
-			zh_entry++;
-			continue;
-		}
-		l0 = zh_entry * layer1_size; //词的offset
+/* Adds step * weight, clipped, to 8 embedding values. Returns the NaN mask
+ * of step */
+__attribute__((target("avx2,fma")))
+static inline int ApplyStep256(real *embeddings, __m256 step, real weight) {
+	int nan = _mm256_movemask_ps(_mm256_cmp_ps(step, step, _CMP_UNORD_Q));
+	step = _mm256_mul_ps(step, _mm256_set1_ps(weight));
+	if (CLIP_UPDATES != 0)
+		step = _mm256_max_ps(_mm256_min_ps(step, _mm256_set1_ps(CLIP_UPDATES)), _mm256_set1_ps(-CLIP_UPDATES));
+	_mm256_storeu_ps(embeddings, _mm256_add_ps(_mm256_loadu_ps(embeddings), step));
+	return nan;
+}
 
-		// 遍历义原
-		for (a = 0; a < sememe_size; a++) {
-			// 判断当前义原是否属于当前词
-			sememe_in_word = 0;
-			for (b = 0; b < hownet[hownet_idx].sememe_num; b++)
-				if (hownet[hownet_idx].sememe_idx[b] == a) {
-					sememe_in_word = 1;
-					break;
-				}
-			if (sememe_in_word == 0) { // 当前义原不属于当前词，则随机丢弃
-				srand((unsigned)time(NULL));
-				if (rand() / (real) RAND_MAX > 0.005)
-					continue;
-			}
-			l1 = a * layer1_size; // 义原的offset
-			// 计算loss
-			delta = 0;
-			for (c = 0; c < layer1_size; c++)
-				delta += (syn0[l0 + c] + syn1neg[l0 + c]) * (sememe_vec1[l1 + c] + sememe_vec2[l1 + c]) / 2; // 这里应不应该除以2？
-			delta += word_bias[hownet_idx] + sememe_bias[a] - sememe_in_word;
-			printf("The delta for word:%s  sememe:%s is %f\n", hownet[hownet_idx].word, sememes[a].word, delta);
-			// 义原向量更新
-			for (c = 0; c < layer1_size; c++) {
-				sememe_grad = delta * 2 * (syn0[l0 + c] + syn1neg[l0 + c]) / 2;
-				//printf("The %d-th grad for word %s's sememe:%s  is %f\n", c,  hownet[hownet_idx].word, sememes[a].word, sememe_grad);
+/* Rounds 8 reals to bf16 as @RealToBf16 does with the offsets of step to
+ * step + 7; the results are in the low halves of the lanes */
+__attribute__((target("avx2,fma")))
+static inline __m256i RoundBf16x8(__m256 x, unsigned int step) {
+	__m256i bits = _mm256_castps_si256(x), rounded;
+	__m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffffff)),
+	                                 _mm256_set1_epi32(0x7f800000));
+	rounded = _mm256_add_epi32(bits, _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_add_epi32(
+	              _mm256_set1_epi32(step), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+	          _mm256_set1_epi32((int) 2654435769u)), 16));
+	rounded = _mm256_blendv_epi8(rounded, _mm256_or_si256(bits, _mm256_set1_epi32(0x400000)), nan);
+	return _mm256_srli_epi32(rounded, 16);
+}
 
-				sememe_vec1[l1 + c] -= ClipStep(alpha * sememe_grad / sememe_vec_ada1[l1 + c]);
-				sememe_vec2[l1 + c] -= ClipStep(alpha * sememe_grad / sememe_vec_ada2[l1 + c]);// AdaGrad写的对吗？
+/* Same as @UpdateScalar, 8 values at a time */
+__attribute__((target("avx2,fma")))
+void UpdateAvx2(real *embeddings, real *grads, int n, const real *deltas, real weight) {
+	__m256 rate = _mm256_set1_ps(alpha), d, g, step;
+	int i = 0, nan = 0;
+	for (; i + 8 <= n; i += 8) {
+		d = _mm256_loadu_ps(deltas + i);
+		if (adagrad) {
+			g = _mm256_fmadd_ps(d, d, _mm256_loadu_ps(grads + i));
+			_mm256_storeu_ps(grads + i, g);
+			step = _mm256_mul_ps(_mm256_mul_ps(rate, AdaGradScale256(g)), d);
+		} else
+			step = _mm256_mul_ps(rate, d);
+		nan |= ApplyStep256(embeddings + i, step, weight);
+	}
+	if (nan)
+		fprintf(stderr, "ERROR: step == NaN\n");
+	if (i < n)
+		UpdateScalar(embeddings + i, adagrad ? grads + i : grads, n - i, deltas + i, weight);
+}
 
-				sememe_vec_ada1[l1 + c] += ClipStep(sememe_grad * sememe_grad);
-				sememe_vec_ada2[l1 + c] += ClipStep(sememe_grad * sememe_grad);
-			}
-			// bias更新
-			word_bias[hownet_idx] -= ClipStep(2 * delta * alpha / word_bias_ada[hownet_idx]);
-			word_bias_ada[hownet_idx] += ClipStep(4 * delta * delta);
+/* Same as @UpdateBf16Scalar; the accumulators are widened and rounded back
+ * in registers */
+__attribute__((target("avx2,fma")))
+void UpdateBf16Avx2(real *embeddings, unsigned short *grads, int n, const real *deltas, real weight) {
+	__m256 rate = _mm256_set1_ps(alpha), d, g, step;
+	__m256i bits;
+	int i = 0, nan = 0;
+	for (; i + 8 <= n; i += 8) {
+		d = _mm256_loadu_ps(deltas + i);
+		bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *) (grads + i))), 16);
+		g = _mm256_fmadd_ps(d, d, _mm256_castsi256_ps(bits));
+		step = _mm256_mul_ps(_mm256_mul_ps(rate, AdaGradScale256(g)), d);
+		nan |= ApplyStep256(embeddings + i, step, weight);
+		bits = RoundBf16x8(g, round_step + i);
+		_mm_storeu_si128((__m128i *) (grads + i),
+		                 _mm_packus_epi32(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1)));
+	}
+	round_step += i;
+	if (nan)
+		fprintf(stderr, "ERROR: step == NaN\n");
+	if (i < n)
+		UpdateBf16Scalar(embeddings + i, grads + i, n - i, deltas + i, weight);
+}
 
-			sememe_bias[a] -= ClipStep(2 * delta * alpha / sememe_bias_ada[a]);
-			sememe_bias_ada[a] += ClipStep(4 * delta * delta);
-			// 词向量更新
-			for (c = 0; c < layer1_size; c++) {
-				word_grad = delta * 2 * (sememe_vec1[l1 + c] + sememe_vec2[l1 + c]) / 2;
-				//printf("The %d-th grad for sememe %s's word:%s is %f\n", c, sememes[a].word, hownet[hownet_idx].word, word_grad);
-				syn0[l0 + c] -= ClipStep(alpha * word_grad * SEMEME_LAMBDA); // 这里就简单用负梯度可以么？
-				syn1neg[l0 + c] -= ClipStep(alpha * word_grad * SEMEME_LAMBDA);
-			}
-		} // sememe end
-		zh_entry++;
-	}// while end
-	pthread_exit(NULL);
-	return NULL;
+/* Same as @Bf16ToReal */
+__attribute__((target("avx2,fma")))
+void Bf16ToRealAvx2(real *dst, const unsigned short *src, long long n) {
+	long long i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(
+		                     _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *) (src + i))), 16)));
+	if (i < n)
+		Bf16ToReal(dst + i, src + i, n - i);
 }
 
-real dot_product(real * embeddings0, real * embeddings1, int offset0, int offset1, int length) {
-	real result = 0;
-	int i;
-	for (i = 0; i < length; i++) {
-		result += embeddings0[offset0 + i] * embeddings1[offset1 + i];
+/* Same as @RealToBf16, with the same rounding offsets */
+__attribute__((target("avx2,fma")))
+void RealToBf16Avx2(unsigned short *dst, const real *src, long long n) {
+	__m256i bits;
+	long long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		bits = RoundBf16x8(_mm256_loadu_ps(src + i), round_step + i);
+		_mm_storeu_si128((__m128i *) (dst + i),
+		                 _mm_packus_epi32(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1)));
 	}
-	return result;
+	round_step += i;
+	if (i < n)
+		RealToBf16(dst + i, src + i, n - i);
 }
 
-real add_dot_product(real * embeddings0, real * contexts0, real * embeddings1, real * contexts1, int offset0, int offset1, int length) {
-	real result = 0;
-	int i;
-	for (i = 0; i < length; i++) {
-		result += (embeddings0[offset0 + i] + contexts0[offset0 + i]) * (embeddings1[offset1 + i] + contexts1[offset1 + i]);
-	}
+/* Widens 16 int8 values at a time to int16 and sums the products of pairs
+ * into int32 lanes with madd; 127 * 127 * 2 cannot overflow a lane. CPUs
+ * with AVX-512 also use it, since a 512-bit madd needs AVX-512BW */
+__attribute__((target("avx2,fma")))
+int DotInt8Avx2(const signed char *a, const signed char *b, int n) {
+	__m256i s = _mm256_setzero_si256();
+	__m128i h;
+	int i = 0, result;
+	for (; i + 16 <= n; i += 16)
+		s = _mm256_add_epi32(s, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i *) (a + i))),
+		                                          _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i *) (b + i)))));
+	h = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+	result = _mm_cvtsi128_si32(h);
+	for (; i < n; i++)
+		result += a[i] * b[i];
 	return result;
 }
 
+__attribute__((target("avx512f")))
+real DotAvx512(const real *a, const real *b, int n) {
+	__m512 s = _mm512_setzero_ps();
+	__mmask16 m;
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+		s = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s);
+	if (i < n) {
+		m = (__mmask16) ((1u << (n - i)) - 1);
+		s = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), s);
+	}
+	return _mm512_reduce_add_ps(s);
+}
+
+__attribute__((target("avx512f")))
+real AddDotAvx512(const real *a, const real *c, const real *b, const real *d, int n) {
+	__m512 s = _mm512_setzero_ps();
+	__mmask16 m;
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+		s = _mm512_fmadd_ps(_mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(c + i)),
+		                    _mm512_add_ps(_mm512_loadu_ps(b + i), _mm512_loadu_ps(d + i)), s);
+	if (i < n) {
+		m = (__mmask16) ((1u << (n - i)) - 1);
+		s = _mm512_fmadd_ps(_mm512_add_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, c + i)),
+		                    _mm512_add_ps(_mm512_maskz_loadu_ps(m, b + i), _mm512_maskz_loadu_ps(m, d + i)), s);
+	}
+	return _mm512_reduce_add_ps(s);
+}
+
+/* Same as @UpdateAvx2, 16 values at a time; the tail is masked */
+__attribute__((target("avx512f")))
+void UpdateAvx512(real *embeddings, real *grads, int n, const real *deltas, real weight) {
+	__m512 rate = _mm512_set1_ps(alpha), w = _mm512_set1_ps(weight), max_inv = _mm512_set1_ps(1e6);
+	__m512 clip = _mm512_set1_ps(CLIP_UPDATES), neg_clip = _mm512_set1_ps(-CLIP_UPDATES);
+	__m512 half = _mm512_set1_ps(0.5), three_halves = _mm512_set1_ps(1.5);
+	__m512 d, g, r, step;
+	__mmask16 m;
+	int i, nan = 0;
+	for (i = 0; i < n; i += 16) {
+		m = n - i >= 16 ? (__mmask16) 0xffff : (__mmask16) ((1u << (n - i)) - 1);
+		d = _mm512_maskz_loadu_ps(m, deltas + i);
+		if (adagrad) {
+			g = _mm512_fmadd_ps(d, d, _mm512_maskz_loadu_ps(m, grads + i));
+			_mm512_mask_storeu_ps(grads + i, m, g);
+			r = _mm512_rsqrt14_ps(g);
+			r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, g), _mm512_mul_ps(r, r), three_halves));
+			r = _mm512_min_ps(r, max_inv);
+			step = _mm512_mul_ps(_mm512_mul_ps(rate, r), d);
+		} else
+			step = _mm512_mul_ps(rate, d);
+		nan |= _mm512_mask_cmp_ps_mask(m, step, step, _CMP_UNORD_Q);
+		step = _mm512_mul_ps(step, w);
+		if (CLIP_UPDATES != 0)
+			step = _mm512_max_ps(_mm512_min_ps(step, clip), neg_clip);
+		_mm512_mask_storeu_ps(embeddings + i, m, _mm512_add_ps(_mm512_maskz_loadu_ps(m, embeddings + i), step));
+	}
+	if (nan)
+		fprintf(stderr, "ERROR: step == NaN\n");
+}
+
+/* Same as @RoundBf16x8, 16 values at a time */
+__attribute__((target("avx512f")))
+static inline __m512i RoundBf16x16(__m512 x, unsigned int step) {
+	__m512i bits = _mm512_castps_si512(x), rounded;
+	__mmask16 nan = _mm512_cmpgt_epi32_mask(_mm512_and_si512(bits, _mm512_set1_epi32(0x7fffffff)),
+	                                        _mm512_set1_epi32(0x7f800000));
+	rounded = _mm512_add_epi32(bits, _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_add_epi32(
+	              _mm512_set1_epi32(step), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)),
+	          _mm512_set1_epi32((int) 2654435769u)), 16));
+	rounded = _mm512_mask_mov_epi32(rounded, nan, _mm512_or_si512(bits, _mm512_set1_epi32(0x400000)));
+	return _mm512_srli_epi32(rounded, 16);
+}
+
+/* Same as @UpdateBf16Avx2, 16 values at a time */
+__attribute__((target("avx512f")))
+void UpdateBf16Avx512(real *embeddings, unsigned short *grads, int n, const real *deltas, real weight) {
+	__m512 rate = _mm512_set1_ps(alpha), w = _mm512_set1_ps(weight), max_inv = _mm512_set1_ps(1e6);
+	__m512 clip = _mm512_set1_ps(CLIP_UPDATES), neg_clip = _mm512_set1_ps(-CLIP_UPDATES);
+	__m512 half = _mm512_set1_ps(0.5), three_halves = _mm512_set1_ps(1.5);
+	__m512 d, g, r, step;
+	__m512i bits;
+	int i = 0, nan = 0;
+	for (; i + 16 <= n; i += 16) {
+		d = _mm512_loadu_ps(deltas + i);
+		bits = _mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *) (grads + i))), 16);
+		g = _mm512_fmadd_ps(d, d, _mm512_castsi512_ps(bits));
+		r = _mm512_rsqrt14_ps(g);
+		r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, g), _mm512_mul_ps(r, r), three_halves));
+		r = _mm512_min_ps(r, max_inv);
+		step = _mm512_mul_ps(_mm512_mul_ps(rate, r), d);
+		nan |= _mm512_cmp_ps_mask(step, step, _CMP_UNORD_Q);
+		step = _mm512_mul_ps(step, w);
+		if (CLIP_UPDATES != 0)
+			step = _mm512_max_ps(_mm512_min_ps(step, clip), neg_clip);
+		_mm512_storeu_ps(embeddings + i, _mm512_add_ps(_mm512_loadu_ps(embeddings + i), step));
+		_mm256_storeu_si256((__m256i *) (grads + i), _mm512_cvtepi32_epi16(RoundBf16x16(g, round_step + i)));
+	}
+	round_step += i;
+	if (nan)
+		fprintf(stderr, "ERROR: step == NaN\n");
+	if (i < n)
+		UpdateBf16Scalar(embeddings + i, grads + i, n - i, deltas + i, weight);
+}
+
+/* Same as @Bf16ToRealAvx2, 16 values at a time */
+__attribute__((target("avx512f")))
+void Bf16ToRealAvx512(real *dst, const unsigned short *src, long long n) {
+	long long i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(
+		                     _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *) (src + i))), 16)));
+	if (i < n)
+		Bf16ToReal(dst + i, src + i, n - i);
+}
+
+/* Same as @RealToBf16Avx2, 16 values at a time */
+__attribute__((target("avx512f")))
+void RealToBf16Avx512(unsigned short *dst, const real *src, long long n) {
+	long long i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm256_storeu_si256((__m256i *) (dst + i),
+		                    _mm512_cvtepi32_epi16(RoundBf16x16(_mm512_loadu_ps(src + i), round_step + i)));
+	round_step += i;
+	if (i < n)
+		RealToBf16(dst + i, src + i, n - i);
+}
+#endif
+
+struct simd_kernels simd_variants[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{"avx512", DotAvx512, AddDotAvx512, UpdateAvx512, UpdateBf16Avx512, DotInt8Avx2,
+	 Bf16ToRealAvx512, RealToBf16Avx512},
+	{"avx2", DotAvx2, AddDotAvx2, UpdateAvx2, UpdateBf16Avx2, DotInt8Avx2,
+	 Bf16ToRealAvx2, RealToBf16Avx2},
+#endif
+	{"scalar", DotScalar, AddDotScalar, UpdateScalar, UpdateBf16Scalar, DotInt8Scalar,
+	 Bf16ToReal, RealToBf16},
+};
+
+int SimdSupported(struct simd_kernels *k) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (!strcmp(k->name, "avx512"))
+		return __builtin_cpu_supports("avx512f");
+	if (!strcmp(k->name, "avx2"))
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+	return 1;
+}
+
+/* Compares the kernels of k with the scalar ones on random rows of every
+ * length up to 67 (int8 dot products, bf16 conversions, SGD and AdaGrad
+ * updates with real and bf16 accumulators). Returns the number of
+ * results that differ by more than a relative 1e-4 */
+int CheckSimdKernels(struct simd_kernels *k) {
+	real a[67], b[67], c[67], d[67], e1[67], e2[67], g1[67], g2[67], x, y, scale;
+	unsigned int specials[] = {0x7f800000, 0xff800000, 0x7f7fffff, 0x7f800001, 0x7fffffff, 0xffffffff};
+	unsigned short h1[67], h2[67];
+	signed char q1[67], q2[67];
+	real saved_alpha = alpha;
+	int saved_adagrad = adagrad, n, i, errors = 0;
+	unsigned long long next_random = 1;
+
+	alpha = 0.05;
+	for (n = 1; n <= 67; n++) {
+		scale = 0;
+		for (i = 0; i < n; i++) {
+			next_random = next_random * (unsigned long long) 25214903917 + 11;
+			a[i] = ((next_random & 0xFFFF) / (real) 65536 - 0.5);
+			b[i] = (((next_random >> 16) & 0xFFFF) / (real) 65536 - 0.5);
+			c[i] = (((next_random >> 32) & 0xFFFF) / (real) 65536 - 0.5);
+			d[i] = (((next_random >> 48) & 0xFFFF) / (real) 65536 - 0.5);
+			scale += fabs((a[i] + c[i]) * (b[i] + d[i]));
+		}
+		x = k->dot(a, b, n);
+		y = DotScalar(a, b, n);
+		errors += fabs(x - y) > 1e-4 * (scale + 1);
+		x = k->add_dot(a, c, b, d, n);
+		y = AddDotScalar(a, c, b, d, n);
+		errors += fabs(x - y) > 1e-4 * (scale + 1);
+		for (i = 0; i < n; i++) {
+			q1[i] = (signed char) (a[i] * 254);
+			q2[i] = i % 7 == 0 ? -127 : (signed char) (b[i] * 254);
+		}
+		errors += k->dot_int8(q1, q2, n) != DotInt8Scalar(q1, q2, n);
+		// bf16 rows: the same rounding offsets give the same values, also
+		// for infinities, NaNs and values that round up to infinity
+		memcpy(e1, a, n * sizeof(real));
+		for (i = 0; i < n; i += 11)
+			memcpy(e1 + i, &specials[i / 11 % 6], sizeof(real));
+		round_step = 0;
+		k->to_bf16(h1, e1, n);
+		round_step = 0;
+		RealToBf16(h2, e1, n);
+		k->from_bf16(e1, h1, n);
+		Bf16ToReal(e2, h2, n);
+		errors += memcmp(h1, h2, n * sizeof(unsigned short)) || memcmp(e1, e2, n * sizeof(real));
+		for (adagrad = 0; adagrad < 2; adagrad++) {
+			for (i = 0; i < n; i++) {
+				e1[i] = e2[i] = a[i];
+				g1[i] = g2[i] = i % 5 == 0 ? 0 : fabs(c[i]);
+			}
+			k->update(e1, g1, n, b, -1.5);
+			UpdateScalar(e2, g2, n, b, -1.5);
+			for (i = 0; i < n; i++)
+				errors += fabs(e1[i] - e2[i]) > 1e-4 * (fabs(e2[i]) + 1e-3)
+				          || fabs(g1[i] - g2[i]) > 1e-4 * (fabs(g2[i]) + 1e-3);
+		}
+		// bf16 accumulators: both kernels see the same rounding offsets, so
+		// they may only differ where rsqrt moved a value across a bf16 step
+		adagrad = 1;
+		for (i = 0; i < n; i++) {
+			e1[i] = e2[i] = a[i];
+			g1[i] = i % 5 == 0 ? 0 : fabs(c[i]);
+		}
+		RealToBf16(h1, g1, n);
+		memcpy(h2, h1, n * sizeof(unsigned short));
+		round_step = 0;
+		k->update_bf16(e1, h1, n, b, -1.5);
+		round_step = 0;
+		UpdateBf16Scalar(e2, h2, n, b, -1.5);
+		Bf16ToReal(g1, h1, n);
+		Bf16ToReal(g2, h2, n);
+		for (i = 0; i < n; i++)
+			errors += fabs(e1[i] - e2[i]) > 1e-4 * (fabs(e2[i]) + 1e-3)
+			          || fabs(g1[i] - g2[i]) > 1e-2 * fabs(g2[i]);
+	}
+	alpha = saved_alpha;
+	adagrad = saved_adagrad;
+	return errors;
+}
+
+/* Picks the kernels named by -simd, or the widest supported ones for "auto".
+ * Kernels that fail @CheckSimdKernels are skipped */
+void SelectSimdKernels() {
+	int i, found = 0, n = sizeof(simd_variants) / sizeof(simd_variants[0]);
+	for (i = 0; i < n; i++) {
+		if (strcmp(simd_name, "auto") && strcmp(simd_name, simd_variants[i].name))
+			continue;
+		found = 1;
+		if (!SimdSupported(&simd_variants[i])) {
+			fprintf(stderr, "WARNING: the CPU does not support %s kernels\n", simd_variants[i].name);
+			continue;
+		}
+		if (CheckSimdKernels(&simd_variants[i]) > 0) {
+			fprintf(stderr, "WARNING: %s kernels disagree with the scalar ones, not using them\n",
+			        simd_variants[i].name);
+			continue;
+		}
+		simd = simd_variants[i];
+		fprintf(stderr, "Using %s kernels\n", simd.name);
+		return;
+	}
+	if (!found) {
+		printf("ERROR: unknown -simd %s\n", simd_name);
+		exit(1);
+	}
+	simd = simd_variants[n - 1];
+	fprintf(stderr, "Using %s kernels\n", simd.name);
+}
+
+/* Updates the row at embeddings with the gradient deltas; grads points to
+ * its AdaGrad accumulators */
+void UpdateRow(real *embeddings, void *grads, int num_updates, real *deltas, real weight) {
+	if (adagrad && grad_precision == PRECISION_BF16) {
+		simd.update_bf16(embeddings, grads, num_updates, deltas, weight);
+		return;
+	}
+	simd.update(embeddings, grads, num_updates, deltas, weight);
+}
+
+/* Row of word in syn0 (m == 0) or syn1neg (m == 1) of lang_id as reals: the
+ * stored row itself, or with bf16 storage a copy widened into buf that
+ * @StoreRow writes back */
+static inline real *LoadRow(int m, int lang_id, long long word, real *buf) {
+	if (param_precision == PRECISION_FP32)
+		return (m ? syn1negs : syn0s)[lang_id] + word * layer1_size;
+	simd.from_bf16(buf, (m ? syn1negh : syn0h)[lang_id] + word * layer1_size, layer1_size);
+	return buf;
+}
+
+/* Writes back a row returned by @LoadRow, rounding it stochastically to
+ * bf16 if needed */
+static inline void StoreRow(int m, int lang_id, long long word, const real *row) {
+	if (param_precision == PRECISION_BF16)
+		simd.to_bf16((m ? syn1negh : syn0h)[lang_id] + word * layer1_size, row, layer1_size);
+}
+
+void LexiconUpdate(long long w_I, long long w_O, int lang_id1, int lang_id2, // w_I,w_O表示词典的一对词，
+                   real lambda, real * delta) {
+	real buf1[layer1_size], buf2[layer1_size], *row1, *row2;
+	int c, m;
+	// m == 0: update input vector, m == 1: update output vector
+	for (m = 0; m < 2; m++) {
+		row1 = LoadRow(m, lang_id1, w_I, buf1);
+		row2 = LoadRow(m, lang_id2, w_O, buf2);
+		for (c = 0; c < layer1_size; c++) {
+			delta[c] = row1[c] - row2[c];
+		}
+		UpdateRow(row1, GradRow(m, lang_id1, w_I), layer1_size, delta, -lambda);
+		UpdateRow(row2, GradRow(m, lang_id2, w_O), layer1_size, delta, lambda);
+		StoreRow(m, lang_id1, w_I, row1);
+		StoreRow(m, lang_id2, w_O, row2);
+	}
+}
+
+void MatchUpdate(long long w_I, long long w_O, int lang_id1, int lang_id2,
+                 real lambda, real * delta) {
+	real buf[4][layer1_size], *in1, *out1, *in2, *out2;
+	int c;
+
+	in1 = LoadRow(0, lang_id1, w_I, buf[0]);
+	out1 = LoadRow(1, lang_id1, w_I, buf[1]);
+	in2 = LoadRow(0, lang_id2, w_O, buf[2]);
+	out2 = LoadRow(1, lang_id2, w_O, buf[3]);
+	for (c = 0; c < layer1_size; c++) {
+		delta[c] = in1[c] + out1[c] - in2[c] - out2[c];
+	} // 这个为什么不像Lexicon Update一样对两套词向量分别计算delta来更新？是因为这个matching是根据平均词向量最相近求出来的？
+
+	//update input vector
+	UpdateRow(in1, GradRow(0, lang_id1, w_I), layer1_size, delta, -lambda);
+	UpdateRow(in2, GradRow(0, lang_id2, w_O), layer1_size, delta, lambda);
+	//update output vector
+	UpdateRow(out1, GradRow(1, lang_id1, w_I), layer1_size, delta, -lambda);
+	UpdateRow(out2, GradRow(1, lang_id2, w_O), layer1_size, delta, lambda);
+	StoreRow(0, lang_id1, w_I, in1);
+	StoreRow(1, lang_id1, w_I, out1);
+	StoreRow(0, lang_id2, w_O, in2);
+	StoreRow(1, lang_id2, w_O, out2);
+}
+
+/* Lexicon objective: continues through the thread_id-th part of the seed
+ * lexicon for budget entries, cycling while the monolingual tasks run */
+void LexiconStep(struct aux_task *t, long long budget) {
+	int thread_id = t->thread_id;
+	long long entry = t->entry;	//entry in the lexicon
+	real deltas1[layer1_size];
+
+	while (budget-- > 0) {
+		if (entry >= lexicon_size / num_threads * (thread_id + 1)) { // 读到了该线程对应词表的末位，则返回起始位置
+			entry = lexicon_size / num_threads * thread_id;
+			continue;
+		}
+		LexiconUpdate(lexicons[0][entry], lexicons[1][entry], 0, 1, LEXICON_LAMBDA, deltas1);
+		//LexiconUpdate(lexicons[1][entry], lexicons[0][entry], 1, 0, LEXICON_LAMBDA, deltas1, deltas2);
+		entry++;
+	}
+	t->entry = entry;
+}
+// 从HowNet中找当前词表中的词
+
+int SearchHowNet(long long entry) {
+	char * word = VocabWord(1, entry);
+	unsigned int hash = GetHowNetHash(word);
+	while (1) {
+		if (hownet_hash[hash] == -1)
+			return -1;
+		if (!strcmp(word, sememe_arena.data + hownet[hownet_hash[hash]].word))
+			return hownet_hash[hash];
+		hash = (hash + 1) % HOWNET_HASH_SIZE;
+	}
+	return -1;
+}
+real ClipStep(real step) {
+	if (CLIP_UPDATES > 0) {
+		if (step > CLIP_UPDATES)
+			return CLIP_UPDATES;
+		if (step < -CLIP_UPDATES)
+			return -CLIP_UPDATES;
+	}
+	return step;
+}
+
+/* One step of the sememe objective for the Chinese word with rows syn0 and
+ * syn1neg (see @LoadRow), which is HowNet word hownet_idx, and sememe a;
+ * label is 1 if a is a sememe of the word */
+void SememeUpdate(real *syn0, real *syn1neg, int hownet_idx, int a, int label) {
+	int c;
+	long long l1 = a * layer1_size; // 义原的offset
+	real delta, sememe_grad, word_grad;
+
+	// 计算loss
+	delta = 0;
+	for (c = 0; c < layer1_size; c++)
+		delta += (syn0[c] + syn1neg[c]) * (sememe_vec1[l1 + c] + sememe_vec2[l1 + c]) / 2; // 这里应不应该除以2？
+	delta += word_bias[hownet_idx] + sememe_bias[a] - label;
+	if (debug_mode > 2)
+		printf("The delta for word:%s  sememe:%s is %f\n", sememe_arena.data + hownet[hownet_idx].word,
+		       sememe_arena.data + sememes[a].word, delta);
+	// 义原向量更新
+	for (c = 0; c < layer1_size; c++) {
+		sememe_grad = delta * 2 * (syn0[c] + syn1neg[c]) / 2;
+		//printf("The %d-th grad for word %s's sememe:%s  is %f\n", c,  hownet[hownet_idx].word, sememes[a].word, sememe_grad);
+
+		sememe_vec1[l1 + c] -= ClipStep(alpha * sememe_grad / sememe_vec_ada1[l1 + c]);
+		sememe_vec2[l1 + c] -= ClipStep(alpha * sememe_grad / sememe_vec_ada2[l1 + c]);// AdaGrad写的对吗？
+
+		sememe_vec_ada1[l1 + c] += ClipStep(sememe_grad * sememe_grad);
+		sememe_vec_ada2[l1 + c] += ClipStep(sememe_grad * sememe_grad);
+	}
+	// bias更新
+	word_bias[hownet_idx] -= ClipStep(2 * delta * alpha / word_bias_ada[hownet_idx]);
+	word_bias_ada[hownet_idx] += ClipStep(4 * delta * delta);
+
+	sememe_bias[a] -= ClipStep(2 * delta * alpha / sememe_bias_ada[a]);
+	sememe_bias_ada[a] += ClipStep(4 * delta * delta);
+	// 词向量更新
+	for (c = 0; c < layer1_size; c++) {
+		word_grad = delta * 2 * (sememe_vec1[l1 + c] + sememe_vec2[l1 + c]) / 2;
+		//printf("The %d-th grad for sememe %s's word:%s is %f\n", c, sememes[a].word, hownet[hownet_idx].word, word_grad);
+		syn0[c] -= ClipStep(alpha * word_grad * SEMEME_LAMBDA); // 这里就简单用负梯度可以么？
+		syn1neg[c] -= ClipStep(alpha * word_grad * SEMEME_LAMBDA);
+	}
+}
+
+/* Trains the sememe objective on Chinese word zh_entry, which is HowNet word
+ * hownet_idx: all its sememes are positives and sememe_negative random
+ * sememes are negatives. Negatives that happen to be sememes of the word are
+ * skipped, membership is tested through the bitset in_word of the caller */
+void SememeWord(long long zh_entry, int hownet_idx, unsigned int *in_word,
+                unsigned long long *next_random) {
+	int a, d, negatives = sememe_negative;
+	long long b;
+	real buf0[layer1_size], buf1[layer1_size];
+	real *syn0 = LoadRow(0, 1, zh_entry, buf0), *syn1neg = LoadRow(1, 1, zh_entry, buf1); // 词向量
+
+	if (negatives < 0)
+		negatives = sememe_size / 200 > 0 ? sememe_size / 200 : 1;
+	if (sememe_size == 0)
+		negatives = 0;
+	// 正例：该词的义原
+	for (b = hownet_offsets[hownet_idx]; b < hownet_offsets[hownet_idx + 1]; b++) {
+		a = hownet_sememes[b];
+		in_word[a / 32] |= 1u << (a % 32);
+		SememeUpdate(syn0, syn1neg, hownet_idx, a, 1);
+	}
+	// 负例：随机采样不属于该词的义原
+	for (d = 0; d < negatives; d++) {
+		*next_random = *next_random * (unsigned long long) 25214903917 + 11;
+		a = (*next_random >> 16) % sememe_size;
+		if (in_word[a / 32] & (1u << (a % 32)))
+			continue;
+		SememeUpdate(syn0, syn1neg, hownet_idx, a, 0);
+	}
+	for (b = hownet_offsets[hownet_idx]; b < hownet_offsets[hownet_idx + 1]; b++)
+		in_word[hownet_sememes[b] / 32] = 0;
+	StoreRow(0, 1, zh_entry, syn0);
+	StoreRow(1, 1, zh_entry, syn1neg);
+}
+
+/* Trains the sememe objective on budget words of the thread_id-th part of
+ * hownet_words, see @SememeWord */
+void SememeStep(struct aux_task *t, long long budget) {
+	int thread_id = t->thread_id;
+	long long entry = t->entry, zh_entry;
+	long long first = hownet_word_count * thread_id / num_threads;
+	long long last = hownet_word_count * (thread_id + 1) / num_threads;
+
+	if (first == last)
+		return;
+	while (budget-- > 0) {
+		if (entry >= last) // 读到了该线程对应词表的末位，则返回起始位置
+			entry = first;
+		zh_entry = hownet_words[entry++];
+		SememeWord(zh_entry, vocab_hownet[zh_entry], t->in_word, &t->next_random);
+	}// while end
+	t->entry = entry;
+}
+
+/* Maps the Chinese vocabulary to HowNet once, after @ReadHowNet, so that
+ * the sememe objective does no string work */
+void InitHowNetIndex() {
+	long long w;
+
+	vocab_hownet = malloc(vocab_sizes[1] * sizeof(int));
+	hownet_words = malloc(vocab_sizes[1] * sizeof(long long));
+	hownet_word_count = 0;
+	for (w = 0; w < vocab_sizes[1]; w++) {
+		vocab_hownet[w] = SearchHowNet(w);// 给定一个词在当前词表中的index，返回该词在hownet词典中的index
+		if (vocab_hownet[w] != -1)
+			hownet_words[hownet_word_count++] = w;
+	}
+	if (debug_mode > 0)
+		fprintf(stderr, "%lld of %lld Chinese words are in HowNet\n", hownet_word_count,
+		        vocab_sizes[1]);
+}
+
+/* Sets up -fused-aux: the lexicon entries of every word and the probability
+ * that an occurrence of a word trains its auxiliary objectives. A positive fused_aux is that
+ * probability for every word; a negative one gives every word -fused_aux
+ * auxiliary updates per epoch on average, as the separate tasks did, so
+ * the probability is -fused_aux / count */
+void InitFusedAux() {
+	int lang_id;
+	long long a, w, vocab_size, *fill;
+	double p;
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		vocab_size = vocab_sizes[lang_id];
+		lexicon_offsets[lang_id] = calloc(vocab_size + 1, sizeof(long long));
+		lexicon_entries[lang_id] = malloc((lexicon_size + 1) * sizeof(long long));
+		fill = malloc(vocab_size * sizeof(long long));
+		for (a = 0; a < lexicon_size; a++)
+			lexicon_offsets[lang_id][lexicons[lang_id][a] + 1]++;
+		for (w = 0; w < vocab_size; w++) {
+			lexicon_offsets[lang_id][w + 1] += lexicon_offsets[lang_id][w];
+			fill[w] = lexicon_offsets[lang_id][w];
+		}
+		for (a = 0; a < lexicon_size; a++)
+			lexicon_entries[lang_id][fill[lexicons[lang_id][a]]++] = a;
+		free(fill);
+
+		fused_keeps[lang_id] = calloc(vocab_size, sizeof(unsigned int));
+		for (w = 1; w < vocab_size; w++) {
+			if (lexicon_offsets[lang_id][w + 1] == lexicon_offsets[lang_id][w]
+			        && (lang_id != 1 || vocab_hownet[w] == -1))
+				continue;       // nothing to train
+			p = fused_aux > 0 ? fused_aux : -fused_aux / vocabs[lang_id][w].cn;
+			fused_keeps[lang_id][w] = p >= 1 ? 0xFFFFFFFF : p * 4294967296.0;
+		}
+	}
+}
+
+real dot_product(real * embeddings0, real * embeddings1, int offset0, int offset1, int length) {
+	return simd.dot(embeddings0 + offset0, embeddings1 + offset1, length);
+}
+
+real add_dot_product(real * embeddings0, real * contexts0, real * embeddings1, real * contexts1, int offset0, int offset1, int length) {
+	return simd.add_dot(embeddings0 + offset0, contexts0 + offset0, embeddings1 + offset1, contexts1 + offset1, length);
+}
+
 real lookupExpTable(real x) {
 	if (x >= MAX_EXP) return expTable[EXP_TABLE_SIZE - 1];
 	if (x < -MAX_EXP) return expTable[0];
 	return expTable[(int) ((x + MAX_EXP) / MAX_EXP / 2 * EXP_TABLE_SIZE)];
 }
 
-void *MatchingT2SThread(void *id) {
-	char LOCAL_ALL_MONO_DONE;
-	int thread_id = (int) id % num_threads, j, m;
-	long long max_src_entry, src_entry, max_tgt_entry, tgt_entry, l0, l1;
-	long long src_vocab_size = vocab_sizes[0], tgt_vocab_size = vocab_sizes[1];
-	real deltas1[layer1_size], deltas2[layer1_size];
-	real src_norm, max_src_norm, tgt_norm, cos_sim, max_cos_sim, norm;
-	char valid;
-
-	//src_entry = src_vocab_size / num_threads * thread_id;
-	tgt_entry = tgt_vocab_size / num_threads * thread_id; // 该线程处理的目标语言词表起始位置
-
-	// Continue training while monolingual models are still training
-	while (1) { //(MONO_DONE_TRAINING < NUM_LANG * num_threads) {
-		pthread_rwlock_rdlock(&lock);
-		LOCAL_ALL_MONO_DONE = ALL_MONO_DONE;
-		pthread_rwlock_unlock(&lock);
-		if (LOCAL_ALL_MONO_DONE) break;  // 如果单语线程已经结束，那么退出；否则一直训练
-		if (tgt_entry >= tgt_vocab_size / num_threads * (thread_id + 1)) { // 读到了该线程对应词表的末位，则返回起始位置
-			tgt_entry = tgt_vocab_size / num_threads * thread_id;
-			continue;
+// Candidates of the matching threads. For every word of a language that is
+// not in the seed lexicon (and is not </s>), the cache holds the combined
+// vector syn0 + syn1neg and its inverse norm in one compact row. The rows are
+// refreshed in place once per pass over the vocabulary, see @RefreshMatchCache
+#define MATCH_BLOCK 16	// query words scored together
+#define MATCH_TILE 256	// candidate rows scored per query block before moving on
+struct match_cache {
+	long long size;
+	long long *ids;		// vocabulary id of every row
+	real *vecs;
+	real *inv_norms;
+};
+struct match_cache match_caches[NUM_LANG];
+
+// Result of the last search for every word (-match-drift). The best row is
+// reused without a search while neither the word's inverse norm nor its
+// partner's moved by more than match_drift (relative) since the search, for
+// at most match_max_age passes
+struct match_memo {
+	long long row;			// row of the other language's match_cache, -1 if not searched yet
+	real inv_norm, partner_inv_norm;	// inverse norms at the time of the search
+	int age;			// passes the row has been reused
+};
+struct match_memo *match_memos[NUM_LANG];
+real match_drift = 0;
+int match_max_age = 8;
+long long match_hits[NUM_LANG], match_searches[NUM_LANG];	// per query language, reset every epoch
+
+char *VocabInLexicon(int lang_id) {
+	return lang_id == 0 ? srcVocabInLexicon : tgtVocabInLexicon;
+}
+
+/* Writes syn0 + syn1neg of word of lang_id to vec and returns its inverse
+ * norm, 0 for a zero vector */
+real CombinedVector(int lang_id, long long word, real *vec) {
+	long long c;
+	real norm = 0, buf0[layer1_size], buf1[layer1_size];
+	real *syn0 = LoadRow(0, lang_id, word, buf0), *syn1neg = LoadRow(1, lang_id, word, buf1);
+	for (c = 0; c < layer1_size; c++) {
+		vec[c] = syn0[c] + syn1neg[c];
+		norm += vec[c] * vec[c];
+	}
+	return norm > 0 ? 1 / sqrt(norm) : 0;
+}
+
+void RefreshMatchCache(int lang_id) {
+	struct match_cache *cache = &match_caches[lang_id];
+	long long a;
+	for (a = 0; a < cache->size; a++)
+		cache->inv_norms[a] = CombinedVector(lang_id, cache->ids[a], cache->vecs + a * layer1_size);
+}
+
+/* Allocates the candidate rows of lang_id, the lexicon must be loaded */
+void InitMatchCache(int lang_id) {
+	struct match_cache *cache = &match_caches[lang_id];
+	char *in_lexicon = VocabInLexicon(lang_id);
+	long long a, b = 0;
+
+	for (a = 1; a < vocab_sizes[lang_id]; a++)
+		if (!in_lexicon[a])
+			b++;
+	cache->size = b;
+	cache->ids = malloc((b + 1) * sizeof(long long));
+	cache->inv_norms = malloc((b + 1) * sizeof(real));
+	a = posix_memalign((void **) &cache->vecs, 128, (b + 1) * layer1_size * sizeof(real));
+	if (cache->ids == NULL || cache->inv_norms == NULL || cache->vecs == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 1, b = 0; a < vocab_sizes[lang_id]; a++)
+		if (!in_lexicon[a])
+			cache->ids[b++] = a;
+	RefreshMatchCache(lang_id);
+
+	match_memos[lang_id] = malloc(vocab_sizes[lang_id] * sizeof(struct match_memo));
+	if (match_memos[lang_id] == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < vocab_sizes[lang_id]; a++)
+		match_memos[lang_id][a].row = -1;
+}
+
+/* Looks up the last match of word of q_lang, whose combined vector is v with
+ * inverse norm v_inv. Returns 1 and the cosine similarity to the remembered
+ * row if it can be reused, 0 if the word has to be searched again */
+int MatchMemoHit(int q_lang, long long word, real *v, real v_inv, real *sim, long long *row) {
+	struct match_memo *memo = &match_memos[q_lang][word];
+	struct match_cache *cache = &match_caches[1 - q_lang];
+	real f = 0, *c;
+	long long k;
+
+	if (match_drift <= 0 || memo->row < 0 || memo->age >= match_max_age)
+		return 0;
+	if (fabs(v_inv - memo->inv_norm) > match_drift * memo->inv_norm
+	    || fabs(cache->inv_norms[memo->row] - memo->partner_inv_norm) > match_drift * memo->partner_inv_norm)
+		return 0;
+	c = cache->vecs + memo->row * layer1_size;
+	for (k = 0; k < layer1_size; k++)
+		f += v[k] * c[k];
+	*sim = f * v_inv * cache->inv_norms[memo->row];
+	*row = memo->row;
+	memo->age++;
+	return 1;
+}
+
+/* Remembers the result of a search for word of q_lang */
+void MatchMemoStore(int q_lang, long long word, real v_inv, long long row) {
+	struct match_memo *memo = &match_memos[q_lang][word];
+	memo->row = row;
+	memo->inv_norm = v_inv;
+	memo->partner_inv_norm = row >= 0 ? match_caches[1 - q_lang].inv_norms[row] : 0;
+	memo->age = 0;
+}
+
+/* Finds the most similar row of cache for each of the nq query vectors q
+ * (with inverse norms q_inv). Tiles of MATCH_TILE candidate rows are scored
+ * against all queries while they are in cache, four queries at a time so
+ * that every candidate value loaded is used four times. best_sim[i] and
+ * best_row[i] keep the running maximum; only strictly larger similarities
+ * replace it, so ties go to the first row like in a sequential scan */
+void MatchBlock(struct match_cache *cache, real *q, real *q_inv, int nq,
+                real *best_sim, long long *best_row) {
+	long long tile, tile_end, j, k;
+	int i;
+	real f0, f1, f2, f3, *c, *q0, *q1, *q2, *q3;
+
+	for (tile = 0; tile < cache->size; tile += MATCH_TILE) {
+		tile_end = tile + MATCH_TILE < cache->size ? tile + MATCH_TILE : cache->size;
+		for (i = 0; i + 4 <= nq; i += 4) {
+			q0 = q + i * layer1_size;
+			q1 = q0 + layer1_size;
+			q2 = q1 + layer1_size;
+			q3 = q2 + layer1_size;
+			for (j = tile; j < tile_end; j++) {
+				c = cache->vecs + j * layer1_size;
+				f0 = f1 = f2 = f3 = 0;
+				for (k = 0; k < layer1_size; k++) {
+					f0 += q0[k] * c[k];
+					f1 += q1[k] * c[k];
+					f2 += q2[k] * c[k];
+					f3 += q3[k] * c[k];
+				}
+				f0 *= q_inv[i] * cache->inv_norms[j];
+				f1 *= q_inv[i + 1] * cache->inv_norms[j];
+				f2 *= q_inv[i + 2] * cache->inv_norms[j];
+				f3 *= q_inv[i + 3] * cache->inv_norms[j];
+				if (f0 > best_sim[i]) { best_sim[i] = f0; best_row[i] = j; }
+				if (f1 > best_sim[i + 1]) { best_sim[i + 1] = f1; best_row[i + 1] = j; }
+				if (f2 > best_sim[i + 2]) { best_sim[i + 2] = f2; best_row[i + 2] = j; }
+				if (f3 > best_sim[i + 3]) { best_sim[i + 3] = f3; best_row[i + 3] = j; }
+			}
 		}
-		if (tgtVocabInLexicon[tgt_entry]) { // 如果当前词在词典中，则跳过。
-			tgt_entry++;
-			continue;
+		for (; i < nq; i++) {
+			q0 = q + i * layer1_size;
+			for (j = tile; j < tile_end; j++) {
+				c = cache->vecs + j * layer1_size;
+				f0 = 0;
+				for (k = 0; k < layer1_size; k++)
+					f0 += q0[k] * c[k];
+				f0 *= q_inv[i] * cache->inv_norms[j];
+				if (f0 > best_sim[i]) { best_sim[i] = f0; best_row[i] = j; }
+			}
+		}
+	}
+}
+
+// Optional inverted file index over the rows of a match_cache (-match-ivf).
+// The rows are clustered by spherical k-means around nlist centroids; a query
+// only scans the rows of the match_nprobe lists whose centroids are closest.
+// A background thread rebuilds the index every match_ivf_rebuild seconds and
+// swaps it in under ivf_lock
+#define IVF_ITERS 5		// k-means iterations
+#define IVF_SAMPLE 64		// k-means training rows per list
+#define IVF_RECALL_SAMPLE 256	// queries of the recall report
+struct ivf_index {
+	int nlist;
+	real *centroids;	// nlist unit vectors
+	long long *offsets;	// rows of list i are rows[offsets[i]] .. rows[offsets[i + 1] - 1]
+	long long *rows;
+};
+struct ivf_index *match_ivfs[NUM_LANG];
+int match_ivf = 0, match_nprobe = 8, match_ivf_rebuild = 60;
+pthread_rwlock_t ivf_lock;
+volatile char ivf_stop;
+
+/* Returns the centroid of ivf closest to the unit vector v */
+int IvfNearest(real *centroids, int nlist, real *v) {
+	int i, best = 0;
+	long long k;
+	real f, best_f = -2;
+	for (i = 0; i < nlist; i++) {
+		f = 0;
+		for (k = 0; k < layer1_size; k++)
+			f += centroids[i * layer1_size + k] * v[k];
+		if (f > best_f) {
+			best_f = f;
+			best = i;
 		}
-		l1 = tgt_entry * layer1_size;
-		tgt_norm = sqrt(add_dot_product(syn0s[1], syn1negs[1], syn0s[1], syn1negs[1], l1, l1, layer1_size));// 这个不用除以2吗
-		max_cos_sim = -1;
-		for (src_entry = 1; src_entry < src_vocab_size; src_entry++) { // 对每个源语言词
-			if (srcVocabInLexicon[src_entry]) continue; // 若该词在词典中，则跳过
-			l0 = src_entry * layer1_size;
-			src_norm = sqrt(add_dot_product(syn0s[0], syn1negs[0], syn0s[0], syn1negs[0], l0, l0, layer1_size));
-			cos_sim = add_dot_product(syn0s[0], syn1negs[0], syn0s[1], syn1negs[1], l0, l1, layer1_size) / (src_norm * tgt_norm); // 求出源语言词和当前目标语言词的cos相似度
-			if (cos_sim > max_cos_sim) { // 找到和当前目标语言词最相似的源语言词
-				max_cos_sim = cos_sim;
-				max_src_entry = src_entry;
-				//				max_tgt_norm = tgt_norm;
+	}
+	return best;
+}
+
+/* Clusters the current rows of the match_cache of lang_id */
+struct ivf_index *BuildIvf(int lang_id) {
+	struct match_cache *cache = &match_caches[lang_id];
+	struct ivf_index *ivf;
+	long long a, k, n = cache->size, step, *counts;
+	int i, it, *assign;
+	real *v = malloc(layer1_size * sizeof(real)), *sums, norm;
+
+	if (n == 0)
+		return NULL;
+	ivf = malloc(sizeof(struct ivf_index));
+	ivf->nlist = match_ivf < n ? match_ivf : n;
+	ivf->centroids = malloc(ivf->nlist * layer1_size * sizeof(real));
+	ivf->offsets = calloc(ivf->nlist + 1, sizeof(long long));
+	ivf->rows = malloc(n * sizeof(long long));
+	sums = malloc(ivf->nlist * layer1_size * sizeof(real));
+	counts = malloc(ivf->nlist * sizeof(long long));
+	assign = malloc(n * sizeof(int));
+
+	// start from evenly spaced rows, then train on a strided sample
+	for (i = 0; i < ivf->nlist; i++)
+		for (k = 0; k < layer1_size; k++)
+			ivf->centroids[i * layer1_size + k] = cache->vecs[n / ivf->nlist * i * layer1_size + k]
+			                                      * cache->inv_norms[n / ivf->nlist * i];
+	step = n / ((long long) ivf->nlist * IVF_SAMPLE);
+	if (step < 1)
+		step = 1;
+	for (it = 0; it < IVF_ITERS; it++) {
+		memset(sums, 0, ivf->nlist * layer1_size * sizeof(real));
+		memset(counts, 0, ivf->nlist * sizeof(long long));
+		for (a = 0; a < n; a += step) {
+			for (k = 0; k < layer1_size; k++)
+				v[k] = cache->vecs[a * layer1_size + k] * cache->inv_norms[a];
+			i = IvfNearest(ivf->centroids, ivf->nlist, v);
+			for (k = 0; k < layer1_size; k++)
+				sums[i * layer1_size + k] += v[k];
+			counts[i]++;
+		}
+		for (i = 0; i < ivf->nlist; i++) {
+			if (counts[i] == 0)
+				continue;       // keep the old centroid of an empty list
+			norm = 0;
+			for (k = 0; k < layer1_size; k++)
+				norm += sums[i * layer1_size + k] * sums[i * layer1_size + k];
+			if (norm > 0)
+				for (k = 0; k < layer1_size; k++)
+					ivf->centroids[i * layer1_size + k] = sums[i * layer1_size + k] / sqrt(norm);
+		}
+	}
+
+	// assign all rows and sort them by list
+	for (a = 0; a < n; a++) {
+		for (k = 0; k < layer1_size; k++)
+			v[k] = cache->vecs[a * layer1_size + k] * cache->inv_norms[a];
+		assign[a] = IvfNearest(ivf->centroids, ivf->nlist, v);
+		ivf->offsets[assign[a] + 1]++;
+	}
+	for (i = 0; i < ivf->nlist; i++)
+		ivf->offsets[i + 1] += ivf->offsets[i];
+	memcpy(counts, ivf->offsets, ivf->nlist * sizeof(long long));
+	for (a = 0; a < n; a++)
+		ivf->rows[counts[assign[a]]++] = a;
+	free(v);
+	free(sums);
+	free(counts);
+	free(assign);
+	return ivf;
+}
+
+void FreeIvf(struct ivf_index *ivf) {
+	if (ivf == NULL)
+		return;
+	free(ivf->centroids);
+	free(ivf->offsets);
+	free(ivf->rows);
+	free(ivf);
+}
+
+/* Same as @MatchBlock, but only scans the rows in the match_nprobe lists of
+ * ivf closest to each query */
+void IvfMatch(struct ivf_index *ivf, struct match_cache *cache, real *q, real *q_inv, int nq,
+              real *best_sim, long long *best_row) {
+	int i, l, p, nprobe = match_nprobe < ivf->nlist ? match_nprobe : ivf->nlist;
+	int probe[nprobe];
+	long long j, k, r;
+	real f, probe_f[nprobe], *qi, *c;
+
+	for (i = 0; i < nq; i++) {
+		qi = q + i * layer1_size;
+		// the nprobe closest centroids, kept sorted by similarity
+		for (p = 0; p < nprobe; p++)
+			probe_f[p] = -1e30;
+		for (l = 0; l < ivf->nlist; l++) {
+			f = 0;
+			for (k = 0; k < layer1_size; k++)
+				f += ivf->centroids[l * layer1_size + k] * qi[k];
+			if (f <= probe_f[nprobe - 1])
+				continue;
+			for (p = nprobe - 1; p > 0 && probe_f[p - 1] < f; p--) {
+				probe_f[p] = probe_f[p - 1];
+				probe[p] = probe[p - 1];
 			}
+			probe_f[p] = f;
+			probe[p] = l;
 		}
-		//		printf("max probability = %f\n", max_cos_sim);
-		//		valid = 1;
-		//		l0 = max_src_entry * layer1_size;
-		//		for (j = 1; j < tgt_vocab_size; j++) {
-		//			if (j == tgt_entry) continue;
-		//			l1 = j * layer1_size;
-		//			tgt_norm = sqrt(dot_product(syn0s[1], syn0s[1], l1, l1, layer1_size));
-		//			cos_sim = dot_product(syn0s[0], syn0s[1], l0, l1, layer1_size) / (max_src_norm * tgt_norm);
-		//			if (cos_sim > max_cos_sim) {
-		//				valid = 0;
-		//				break;
-		//			}
-		//		}
-		if (/*valid && */max_cos_sim > threshold) { // 默认值为0.5
-			//			printf("source - target - cos_sim: %s %s %f\n", vocabs[0][src_entry].word, vocabs[1][max_tgt_entry].word, max_cos_sim);
-			printf("target - source - cos_sim: %s %s %f\n", vocabs[1][tgt_entry].word, vocabs[0][max_src_entry].word, max_cos_sim);
-			for (m = 0; m < MSTEP_ITER; m++) {
-				//				LexiconUpdate(src_entry, max_tgt_entry, 0, 1, MATCHING_LAMBDA, deltas1);
-				MatchUpdate(max_src_entry, tgt_entry, 0, 1, MATCHING_LAMBDA * vocabs[1][tgt_entry].cn / train_words[1], deltas1);
+		for (p = 0; p < nprobe; p++)
+			for (j = ivf->offsets[probe[p]]; j < ivf->offsets[probe[p] + 1]; j++) {
+				r = ivf->rows[j];
+				c = cache->vecs + r * layer1_size;
+				f = 0;
+				for (k = 0; k < layer1_size; k++)
+					f += qi[k] * c[k];
+				f *= q_inv[i] * cache->inv_norms[r];
+				if (f > best_sim[i]) {
+					best_sim[i] = f;
+					best_row[i] = r;
+				}
 			}
+	}
+}
+
+/* Finds the best candidates of c_lang for a block of queries, through the
+ * IVF index if there is one */
+void MatchQueries(int c_lang, real *q, real *q_inv, int nq, real *best_sim, long long *best_row) {
+	if (match_ivf > 0) {
+		pthread_rwlock_rdlock(&ivf_lock);
+		if (match_ivfs[c_lang] != NULL) {
+			IvfMatch(match_ivfs[c_lang], &match_caches[c_lang], q, q_inv, nq, best_sim, best_row);
+			pthread_rwlock_unlock(&ivf_lock);
+			return;
 		}
-		tgt_entry++;
-	} // while training loop
-	//	fprintf(stderr, "Exiting matching thread %d. ALL_MONO_DONE = %d\n", (int)id, ALL_MONO_DONE);
+		pthread_rwlock_unlock(&ivf_lock);
+	}
+	MatchBlock(&match_caches[c_lang], q, q_inv, nq, best_sim, best_row);
+}
+
+/* Prints how often the IVF index of c_lang finds the exact best match, for a
+ * sample of IVF_RECALL_SAMPLE query words of the other language */
+void ReportIvfRecall(int c_lang) {
+	int q_lang = 1 - c_lang, nq = 0, i;
+	long long a, hits = 0, exact_row, ivf_row;
+	unsigned long long next_random = 1;
+	char *in_lexicon = VocabInLexicon(q_lang);
+	real *q = malloc(layer1_size * sizeof(real)), q_inv, exact_sim, ivf_sim;
+	double exact_time = 0, ivf_time = 0;
+	struct timespec t0, t1, t2;
+
+	for (i = 0; i < IVF_RECALL_SAMPLE * 4 && nq < IVF_RECALL_SAMPLE; i++) {
+		next_random = next_random * (unsigned long long) 25214903917 + 11;
+		a = (next_random >> 16) % vocab_sizes[q_lang];
+		if (a == 0 || in_lexicon[a])
+			continue;
+		q_inv = CombinedVector(q_lang, a, q);
+		exact_sim = ivf_sim = -1;
+		exact_row = ivf_row = -1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		MatchBlock(&match_caches[c_lang], q, &q_inv, 1, &exact_sim, &exact_row);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		MatchQueries(c_lang, q, &q_inv, 1, &ivf_sim, &ivf_row);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		exact_time += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		ivf_time += (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+		hits += ivf_row == exact_row;
+		nq++;
+	}
+	if (nq > 0)
+		fprintf(stderr, "IVF recall@1 for language %d: %.3f on %d words (nlist %d, nprobe %d), "
+		        "%.3f ms vs %.3f ms exact per word\n", c_lang + 1, hits / (real) nq, nq,
+		        match_ivfs[c_lang] != NULL ? match_ivfs[c_lang]->nlist : 0, match_nprobe,
+		        ivf_time * 1000 / nq, exact_time * 1000 / nq);
+	free(q);
+}
+
+/* Replaces the IVF index of lang_id with one built from the current rows */
+void RebuildIvf(int lang_id) {
+	struct ivf_index *ivf = BuildIvf(lang_id), *old;
+	pthread_rwlock_wrlock(&ivf_lock);
+	old = match_ivfs[lang_id];
+	match_ivfs[lang_id] = ivf;
+	pthread_rwlock_unlock(&ivf_lock);
+	FreeIvf(old);
+	if (debug_mode > 0)
+		ReportIvfRecall(lang_id);
+}
+
+/* Rebuilds the IVF indexes every match_ivf_rebuild seconds until ivf_stop */
+void *IvfRebuildThread(void *arg) {
+	int lang_id, t;
+	while (!ivf_stop) {
+		for (t = 0; t < match_ivf_rebuild && !ivf_stop; t++)
+			sleep(1);
+		if (ivf_stop)
+			break;
+		for (lang_id = 0; lang_id < NUM_LANG; lang_id++)
+			RebuildIvf(lang_id);
+	}
 	pthread_exit(NULL);
 	return NULL;
 }
 
-void *MatchingS2TThread(void *id) {
-	char LOCAL_ALL_MONO_DONE;
-	int thread_id = (int) id % num_threads, j, m;
-	long long max_src_entry, src_entry, max_tgt_entry, tgt_entry, l0, l1;
-	long long src_vocab_size = vocab_sizes[0], tgt_vocab_size = vocab_sizes[1];
-	real deltas1[layer1_size], deltas2[layer1_size];
-	real src_norm, max_src_norm, tgt_norm, cos_sim, max_cos_sim, norm;
-	char valid;
-
-	//src_entry = src_vocab_size / num_threads * thread_id;
-	src_entry = src_vocab_size / num_threads * thread_id;
-
-	// Continue training while monolingual models are still training
-	while (1) { //(MONO_DONE_TRAINING < NUM_LANG * num_threads) {
-		pthread_rwlock_rdlock(&lock);
-		LOCAL_ALL_MONO_DONE = ALL_MONO_DONE;
-		pthread_rwlock_unlock(&lock);
-		if (LOCAL_ALL_MONO_DONE) break;
-		if (src_entry >= src_vocab_size / num_threads * (thread_id + 1)) {
-			src_entry = src_vocab_size / num_threads * thread_id;
-			continue;
+/* Matching objective of both directions, continued for budget blocks: the
+ * words of q_lang in the task's part of the vocabulary that are not in the
+ * lexicon are matched
+ * against all candidates of the other language, MATCH_BLOCK words at a time,
+ * unless their last match can be reused (see struct match_memo). A word
+ * whose best cosine similarity is above threshold is pulled towards its
+ * match by @MatchUpdate */
+void MatchingStep(struct aux_task *t, long long budget) {
+	int thread_id = t->thread_id, q_lang = t->lang_id;
+	char *in_lexicon = VocabInLexicon(q_lang);
+	char *lang_names[NUM_LANG] = {"source", "target"};
+	int c_lang = 1 - q_lang, nq, ns, i, m, searched[MATCH_BLOCK];
+	long long entry, match, begin, end, queries[MATCH_BLOCK], best_row[MATCH_BLOCK];
+	long long q_vocab_size = vocab_sizes[q_lang], hits = 0, searches = 0, s_row[MATCH_BLOCK];
+	real deltas1[layer1_size], best_sim[MATCH_BLOCK], q_inv[MATCH_BLOCK], s_sim[MATCH_BLOCK], v_inv;
+	real *q = t->q;
+	struct match_cache *cache = &match_caches[c_lang];
+
+	begin = q_vocab_size / num_threads * thread_id; // 该任务处理的词表起始位置
+	end = q_vocab_size / num_threads * (thread_id + 1);
+	entry = t->entry;
+	while (budget-- > 0) {
+		if (entry >= end) { // 读到了该任务对应词表的末位，则返回起始位置
+			entry = begin;
+			if (thread_id == 0)
+				RefreshMatchCache(c_lang);
+		}
+		// 收集一批不在词典中的词, 只有需要重新搜索的词进入q
+		for (nq = ns = 0; nq < MATCH_BLOCK && entry < end; entry++) {
+			if (in_lexicon[entry]) // 如果当前词在词典中，则跳过。
+				continue;
+			queries[nq] = entry;
+			v_inv = CombinedVector(q_lang, entry, q + ns * layer1_size);
+			if (MatchMemoHit(q_lang, entry, q + ns * layer1_size, v_inv, &best_sim[nq], &best_row[nq])) {
+				nq++;
+				continue;
+			}
+			searched[ns] = nq;
+			q_inv[ns] = v_inv;
+			s_sim[ns] = -1;
+			s_row[ns] = -1;
+			ns++;
+			nq++;
 		}
-		if (srcVocabInLexicon[src_entry]) {
-			src_entry++;
+		MatchQueries(c_lang, q, q_inv, ns, s_sim, s_row);
+		for (i = 0; i < ns; i++) {
+			best_sim[searched[i]] = s_sim[i];
+			best_row[searched[i]] = s_row[i];
+			MatchMemoStore(q_lang, queries[searched[i]], q_inv[i], s_row[i]);
+		}
+		hits += nq - ns;
+		searches += ns;
+		for (i = 0; i < nq; i++) {
+			if (best_row[i] == -1 || !(best_sim[i] > threshold)) // 默认值为0.5
+				continue;
+			match = cache->ids[best_row[i]];
+			printf("%s - %s - cos_sim: %s %s %f\n", lang_names[q_lang], lang_names[c_lang],
+			       VocabWord(q_lang, queries[i]), VocabWord(c_lang, match), best_sim[i]);
+			for (m = 0; m < MSTEP_ITER; m++) {
+				if (q_lang == 0)
+					MatchUpdate(queries[i], match, 0, 1, MATCHING_LAMBDA * vocabs[0][queries[i]].cn / train_words[0], deltas1);
+				else
+					MatchUpdate(match, queries[i], 0, 1, MATCHING_LAMBDA * vocabs[1][queries[i]].cn / train_words[1], deltas1);
+			}
+		}
+	}
+	t->entry = entry;
+	__sync_fetch_and_add(&match_hits[q_lang], hits);
+	__sync_fetch_and_add(&match_searches[q_lang], searches);
+}
+
+/* Value i of the saved vectors vec1 + vec2; vec2 is NULL when the caller
+ * summed them already */
+static inline real SavedValue(real *vec1, real *vec2, long long i) {
+	return vec2 != NULL ? vec1[i] + vec2[i] : vec1[i];
+}
+
+/* Dot product of rows a and b of the saved vectors vec1 + vec2 */
+real SavedDot(real *vec1, real *vec2, long long a, long long b) {
+	if (vec2 == NULL)
+		return simd.dot(vec1 + a * layer1_size, vec1 + b * layer1_size, layer1_size);
+	return add_dot_product(vec1, vec2, vec1, vec2, a * layer1_size, b * layer1_size, layer1_size);
+}
+
+/* Quantizes vec1 + vec2 of row a to a DTYPE_INT8 row at out: the largest
+ * absolute value maps to 127 */
+void QuantizeRow(char *out, real *vec1, real *vec2, long long a) {
+	float scale, norm;
+	signed char *q = (signed char *) (out + 2 * sizeof(float));
+	real v, max = 0;
+	long long b, sum = 0;
+
+	for (b = 0; b < layer1_size; b++) {
+		v = fabs(SavedValue(vec1, vec2, a * layer1_size + b));
+		if (v > max)
+			max = v;
+	}
+	scale = max > 0 ? max / 127 : 1;
+	for (b = 0; b < layer1_size; b++) {
+		q[b] = (signed char) lrint(SavedValue(vec1, vec2, a * layer1_size + b) / scale);
+		sum += q[b] * q[b];
+	}
+	norm = scale * sqrt(sum);
+	memcpy(out, &scale, sizeof(float));
+	memcpy(out + sizeof(float), &norm, sizeof(float));
+}
+
+#define QUANT_SAMPLE 256		// rows whose nearest neighbour is checked
+#define QUANT_CANDIDATES 16384	// rows they are compared to
+
+/* Prints how much the int8 rows (row_stride bytes each) lose against the
+ * real vectors vec1 + vec2: the cosine between each row and its quantized
+ * version and, with -debug 3 or more, how often the nearest neighbour of a
+ * sampled row among QUANT_CANDIDATES evenly spaced rows is still the same
+ * when it is found with int8 dot products */
+void ReportQuantizationLoss(long long count, char *rows, long long row_stride, real *vec1, real *vec2) {
+	long long a, b, best, best_q, hits = 0, samples = 0, step, candidate_step;
+	real *inv_norms = malloc(count * sizeof(real)), cos, min_cos = 1, best_f, best_q_f, f;
+	float scale_a, norm_a, scale_b, norm_b;
+	double sum_cos = 0;
+	signed char *q;
+
+	for (a = 0; a < count; a++) {
+		f = SavedDot(vec1, vec2, a, a);
+		inv_norms[a] = f > 0 ? 1 / sqrt(f) : 0;
+		memcpy(&scale_a, rows + a * row_stride, sizeof(float));
+		memcpy(&norm_a, rows + a * row_stride + sizeof(float), sizeof(float));
+		q = (signed char *) (rows + a * row_stride + 2 * sizeof(float));
+		cos = 0;
+		for (b = 0; b < layer1_size; b++)
+			cos += SavedValue(vec1, vec2, a * layer1_size + b) * q[b];
+		cos = norm_a > 0 && inv_norms[a] > 0 ? cos * scale_a * inv_norms[a] / norm_a : 1;
+		sum_cos += cos;
+		if (cos < min_cos)
+			min_cos = cos;
+	}
+	fprintf(stderr, "int8 export: cosine to the real vectors %.5f on average, %.5f at least\n",
+	        count > 0 ? sum_cos / count : 1, min_cos);
+	if (debug_mode <= 2) {
+		free(inv_norms);
+		return;
+	}
+	step = count / QUANT_SAMPLE > 0 ? count / QUANT_SAMPLE : 1;
+	candidate_step = count / QUANT_CANDIDATES > 0 ? count / QUANT_CANDIDATES : 1;
+	for (a = 0; a < count; a += step) {
+		memcpy(&scale_a, rows + a * row_stride, sizeof(float));
+		memcpy(&norm_a, rows + a * row_stride + sizeof(float), sizeof(float));
+		if (norm_a == 0 || inv_norms[a] == 0)
 			continue;
+		best = best_q = -1;
+		best_f = best_q_f = -2;
+		for (b = 0; b < count; b += candidate_step) {
+			if (b == a || inv_norms[b] == 0)
+				continue;
+			f = SavedDot(vec1, vec2, a, b) * inv_norms[b];
+			if (f > best_f) {
+				best_f = f;
+				best = b;
+			}
+			memcpy(&scale_b, rows + b * row_stride, sizeof(float));
+			memcpy(&norm_b, rows + b * row_stride + sizeof(float), sizeof(float));
+			f = simd.dot_int8((signed char *) (rows + a * row_stride + 2 * sizeof(float)),
+			                  (signed char *) (rows + b * row_stride + 2 * sizeof(float)), layer1_size)
+			    * scale_b / norm_b;
+			if (f > best_q_f) {
+				best_q_f = f;
+				best_q = b;
+			}
 		}
-		l0 = src_entry * layer1_size;
-		src_norm = sqrt(add_dot_product(syn0s[0], syn1negs[0], syn0s[0], syn1negs[0], l0, l0, layer1_size));
-		max_cos_sim = -1;
-		for (tgt_entry = 1; tgt_entry < tgt_vocab_size; tgt_entry++) {
-			if (tgtVocabInLexicon[tgt_entry]) continue;
-			l1 = tgt_entry * layer1_size;
-			tgt_norm = sqrt(add_dot_product(syn0s[1], syn1negs[1], syn0s[1], syn1negs[1], l1, l1, layer1_size));
-			cos_sim = add_dot_product(syn0s[0], syn1negs[0], syn0s[1], syn1negs[1], l0, l1, layer1_size) / (src_norm * tgt_norm);
-			if (cos_sim > max_cos_sim) {
-				max_cos_sim = cos_sim;
-				max_tgt_entry = tgt_entry;
-				//				max_tgt_norm = tgt_norm;
+		hits += best == best_q;
+		samples++;
+	}
+	fprintf(stderr, "int8 export: nearest neighbour among %lld rows unchanged for %lld of %lld "
+	        "sampled rows\n", (count + candidate_step - 1) / candidate_step, hits, samples);
+	free(inv_norms);
+}
+
+/* Writes count vectors vec1 + vec2 (see @SavedValue) named by words in the
+ * binary format of struct embedding_file_header, as floats or, with
+ * -binary 2, as int8 */
+void SaveEmbeddingsBinary(FILE *fo, long long count, char **words, real *vec1, real *vec2) {
+	struct embedding_file_header header;
+	long long a, b, offset = 0;
+	real *row;
+	char *rows;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CLSPEMB", 8);
+	header.version = EMBEDDING_FILE_VERSION;
+	header.dtype = binary == 2 ? DTYPE_INT8 : DTYPE_FLOAT32;
+	header.count = count;
+	header.dims = layer1_size;
+	if (header.dtype == DTYPE_INT8)
+		header.row_stride = (2 * sizeof(float) + layer1_size + EMBEDDING_ALIGN - 1)
+		                    / EMBEDDING_ALIGN * EMBEDDING_ALIGN;
+	else
+		header.row_stride = (layer1_size * sizeof(real) + EMBEDDING_ALIGN - 1)
+		                    / EMBEDDING_ALIGN * EMBEDDING_ALIGN;
+	header.words_offset = sizeof(header) + count * sizeof(long long);
+	for (a = 0; a < count; a++)
+		header.words_size += strlen(words[a]) + 1;
+	header.data_offset = (header.words_offset + header.words_size + EMBEDDING_ALIGN - 1)
+	                     / EMBEDDING_ALIGN * EMBEDDING_ALIGN;
+	fwrite(&header, sizeof(header), 1, fo);
+	for (a = 0; a < count; a++) {
+		fwrite(&offset, sizeof(long long), 1, fo);
+		offset += strlen(words[a]) + 1;
+	}
+	for (a = 0; a < count; a++)
+		fwrite(words[a], 1, strlen(words[a]) + 1, fo);
+
+	fseek(fo, header.data_offset, SEEK_SET);
+	if (header.dtype == DTYPE_INT8) {
+		rows = calloc(count, header.row_stride);
+		for (a = 0; a < count; a++)
+			QuantizeRow(rows + a * header.row_stride, vec1, vec2, a);
+		fwrite(rows, header.row_stride, count, fo);
+		ReportQuantizationLoss(count, rows, header.row_stride, vec1, vec2);
+		free(rows);
+		return;
+	}
+	row = calloc(header.row_stride, 1);
+	for (a = 0; a < count; a++) {
+		for (b = 0; b < layer1_size; b++)
+			row[b] = SavedValue(vec1, vec2, a * layer1_size + b);
+		fwrite(row, header.row_stride, 1, fo);
+	}
+	free(row);
+}
+
+/* Appends x formatted exactly as printf("%lf", x) does. Floats carry at most
+ * 24 significant bits, so x * 1e6 is exact in a double and rounding it to
+ * the nearest integer (ties to even, like printf) gives the six decimals */
+char *FormatReal(char *p, double x) {
+	unsigned long long bits, n;
+	char digits[24];
+	int a = 0;
+
+	memcpy(&bits, &x, sizeof(bits));
+	if (((bits >> 52) & 0x7ff) == 0x7ff || fabs(x) >= 1e12)
+		return p + sprintf(p, "%lf", x);        // inf, nan and huge values
+	if (bits >> 63)
+		*p++ = '-';
+	n = llrint(fabs(x) * 1e6);
+	for (a = 0; a < 6; a++, n /= 10)
+		digits[a] = '0' + n % 10;
+	digits[a++] = '.';
+	do {
+		digits[a++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	while (a > 0)
+		*p++ = digits[--a];
+	return p;
+}
+
+// Rows formatted per thread and pass by @SaveEmbeddingsText
+#define SAVE_TEXT_ROWS 4096
+struct text_save_job {
+	long long start, end;
+	char **words;
+	real *vec1, *vec2;
+	char *buf;
+	long long size, capacity;
+};
+
+/* Formats the rows [start, end) of a struct text_save_job into its buffer */
+void *FormatRowsThread(void *arg) {
+	struct text_save_job *job = (struct text_save_job *) arg;
+	long long a, b, need;
+	char *p;
+
+	job->size = 0;
+	for (a = job->start; a < job->end; a++) {
+		// a formatted value takes at most 320 bytes (-DBL_MAX)
+		need = job->size + strlen(job->words[a]) + 2 + layer1_size * 320;
+		if (need > job->capacity) {
+			job->capacity = need * 2;
+			job->buf = realloc(job->buf, job->capacity);
+			if (job->buf == NULL) {
+				printf("Memory allocation failed\n");
+				exit(1);
 			}
 		}
-		//		printf("max probability = %f\n", max_cos_sim);
-		//		valid = 1;
-		//		l0 = max_src_entry * layer1_size;
-		//		for (j = 1; j < tgt_vocab_size; j++) {
-		//			if (j == tgt_entry) continue;
-		//			l1 = j * layer1_size;
-		//			tgt_norm = sqrt(dot_product(syn0s[1], syn0s[1], l1, l1, layer1_size));
-		//			cos_sim = dot_product(syn0s[0], syn0s[1], l0, l1, layer1_size) / (max_src_norm * tgt_norm);
-		//			if (cos_sim > max_cos_sim) {
-		//				valid = 0;
-		//				break;
-		//			}
-		//		}
-		if (/*valid && */max_cos_sim > threshold) {
-			printf("source - target - cos_sim: %s %s %f\n", vocabs[0][src_entry].word, vocabs[1][max_tgt_entry].word, max_cos_sim);
-			//			printf("target - source - cos_sim: %s %s %f\n", vocabs[1][tgt_entry].word, vocabs[0][max_src_entry].word, max_cos_sim);
-			for (m = 0; m < MSTEP_ITER; m++) {
-				MatchUpdate(src_entry, max_tgt_entry, 0, 1, MATCHING_LAMBDA * vocabs[0][src_entry].cn / train_words[0], deltas1);
-				//				LexiconUpdate(max_src_entry, tgt_entry, 0, 1, MATCHING_LAMBDA*vocabs[1][tgt_entry].cn/train_words[1], deltas1);
+		p = job->buf + job->size;
+		p = stpcpy(p, job->words[a]);
+		*p++ = ' ';
+		for (b = 0; b < layer1_size; b++) {
+			p = FormatReal(p, SavedValue(job->vec1, job->vec2, a * layer1_size + b));
+			*p++ = ' ';
+		}
+		*p++ = '\n';
+		job->size = p - job->buf;
+	}
+	return NULL;
+}
+
+/* Writes count vectors vec1 + vec2 (see @SavedValue) named by words as text rows. The rows are
+ * formatted by num_threads threads, SAVE_TEXT_ROWS each per pass, and
+ * written in order */
+void SaveEmbeddingsText(FILE *fo, long long count, char **words, real *vec1, real *vec2) {
+	long long a, start = 0;
+	struct text_save_job *jobs = calloc(num_threads, sizeof(struct text_save_job));
+	pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+
+	fprintf(fo, "%lld %lld\n", count, layer1_size);
+	while (start < count) {
+		for (a = 0; a < num_threads; a++) {
+			jobs[a].words = words;
+			jobs[a].vec1 = vec1;
+			jobs[a].vec2 = vec2;
+			jobs[a].start = start < count ? start : count;
+			start += SAVE_TEXT_ROWS;
+			jobs[a].end = start < count ? start : count;
+			pthread_create(&pt[a], NULL, FormatRowsThread, (void *) &jobs[a]);
+		}
+		for (a = 0; a < num_threads; a++) {
+			pthread_join(pt[a], NULL);
+			fwrite(jobs[a].buf, 1, jobs[a].size, fo);
+		}
+	}
+	for (a = 0; a < num_threads; a++)
+		free(jobs[a].buf);
+	free(jobs);
+	free(pt);
+}
+
+void SaveModel(int lang_id, char *name) {
+	long a;
+	char **words = malloc(vocab_sizes[lang_id] * sizeof(char *));
+	real *vec1 = syn0s[lang_id], *vec2 = syn1negs[lang_id];
+	FILE *fo = fopen(name, "wb");
+
+	fprintf(stderr, "\nSaving model to file: %s\n", name);
+	for (a = 0; a < vocab_sizes[lang_id]; a++)
+		words[a] = VocabWord(lang_id, a);
+	// 注意保存的是两套词向量的和
+	if (param_precision == PRECISION_BF16) {
+		// one real matrix of the sums, as much memory as both bf16 matrices
+		vec1 = malloc(vocab_sizes[lang_id] * layer1_size * sizeof(real));
+		vec2 = NULL;
+		for (a = 0; a < vocab_sizes[lang_id]; a++)
+			CombinedVector(lang_id, a, vec1 + a * layer1_size);
+	}
+	if (binary)
+		SaveEmbeddingsBinary(fo, vocab_sizes[lang_id], words, vec1, vec2);
+	else
+		SaveEmbeddingsText(fo, vocab_sizes[lang_id], words, vec1, vec2);
+	if (vec2 == NULL)
+		free(vec1);
+	free(words);
+	fclose(fo);
+}
+void SaveSememe() {
+	int a;
+	char **words = malloc(sememe_size * sizeof(char *));
+	FILE *fo = fopen(save_sememe_file, "wb");
+	fprintf(stderr, "\nSaving sememe embeddings to file: %s\n", save_sememe_file);
+	for (a = 0; a < sememe_size; a++)
+		words[a] = sememe_arena.data + sememes[a].word;
+	if (binary)
+		SaveEmbeddingsBinary(fo, sememe_size, words, sememe_vec1, sememe_vec2);
+	else
+		SaveEmbeddingsText(fo, sememe_size, words, sememe_vec1, sememe_vec2);
+	free(words);
+	fclose(fo);
+}
+
+void WriteParams(FILE *fo, real *params, long long size) {
+	fwrite(params, sizeof(real), size, fo);
+}
+
+void ReadParams(FILE *fin, real *params, long long size) {
+	if (fread(params, sizeof(real), size, fin) != size) {
+		printf("ERROR: %s is truncated!\n", resume_file);
+		exit(1);
+	}
+}
+
+/* Vectors and AdaGrad accumulators are stored as reals in checkpoints
+ * whatever -param-precision and -grad-precision are, so a run can resume
+ * with other precisions. data holds size values stored with precision */
+void WriteStored(FILE *fo, void *data, long long size, int precision) {
+	real buf[4096];
+	long long a, n;
+	if (precision == PRECISION_FP32) {
+		WriteParams(fo, data, size);
+		return;
+	}
+	for (a = 0; a < size; a += n) {
+		n = size - a < 4096 ? size - a : 4096;
+		Bf16ToReal(buf, (unsigned short *) data + a, n);
+		WriteParams(fo, buf, n);
+	}
+}
+
+void ReadStored(FILE *fin, void *data, long long size, int precision) {
+	real buf[4096];
+	long long a, n;
+	if (precision == PRECISION_FP32) {
+		ReadParams(fin, data, size);
+		return;
+	}
+	for (a = 0; a < size; a += n) {
+		n = size - a < 4096 ? size - a : 4096;
+		ReadParams(fin, buf, n);
+		RealToBf16((unsigned short *) data + a, buf, n);
+	}
+}
+
+/* Reads the header of the -resume file. The vocabularies and parameters
+ * that follow are read by @ReadCheckpointVocab and @LoadCheckpoint */
+void OpenCheckpoint() {
+	checkpoint_fin = fopen(resume_file, "rb");
+	if (checkpoint_fin == NULL) {
+		printf("ERROR: checkpoint file (%s) not found!\n", resume_file);
+		exit(1);
+	}
+	if (fread(&resume_header, sizeof(resume_header), 1, checkpoint_fin) != 1
+	        || memcmp(resume_header.magic, "CLSPCKP", 8)
+	        || resume_header.version != CHECKPOINT_VERSION) {
+		printf("ERROR: %s is not a checkpoint!\n", resume_file);
+		exit(1);
+	}
+	if (resume_header.layer1_size != layer1_size || resume_header.adagrad != adagrad) {
+		printf("ERROR: %s was written with -size %lld -adagrad %d!\n", resume_file,
+		       resume_header.layer1_size, resume_header.adagrad);
+		exit(1);
+	}
+	if (resume_header.tasks > 0 && (resume_header.threads != num_threads || prefetch_readers > 0)) {
+		printf("ERROR: %s was written in the middle of an epoch; resume it with -threads %d and without -readers!\n",
+		       resume_file, resume_header.threads);
+		exit(1);
+	}
+	fprintf(stderr, "Resuming from %s in epoch %lld\n", resume_file, resume_header.epoch);
+}
+
+/* Reads the vocabulary of lang_id from the -resume file, in place of
+ * learning it from the training data */
+void ReadCheckpointVocab(int lang_id) {
+	ReadVocabBinary(lang_id, checkpoint_fin, resume_file);
+	if (bin_train_files[lang_id][0] == 0)
+		GetTrainFileSize(lang_id);
+}
+
+/* Reads the parameters of the -resume file into the allocated networks and
+ * restores the training schedule. The task states of a mid-epoch checkpoint
+ * are left to @RestoreTasks */
+void LoadCheckpoint() {
+	int lang_id;
+
+	if (resume_header.sememe_size != sememe_size || resume_header.hownet_size != hownet_size) {
+		printf("ERROR: %s was written with %lld sememes and %lld HowNet words!\n", resume_file,
+		       resume_header.sememe_size, resume_header.hownet_size);
+		exit(1);
+	}
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		ReadStored(checkpoint_fin, ParamMatrix(0, lang_id), vocab_sizes[lang_id] * layer1_size, param_precision);
+		ReadStored(checkpoint_fin, ParamMatrix(1, lang_id), vocab_sizes[lang_id] * layer1_size, param_precision);
+		if (adagrad) {
+			ReadStored(checkpoint_fin, syn0grads[lang_id], vocab_sizes[lang_id] * layer1_size, grad_precision);
+			ReadStored(checkpoint_fin, syn1negGrads[lang_id], vocab_sizes[lang_id] * layer1_size, grad_precision);
+		}
+		epoch[lang_id] = resume_header.epochs[lang_id];
+		dump_iters[lang_id] = resume_header.dump_iters[lang_id];
+	}
+	ReadParams(checkpoint_fin, sememe_vec1, sememe_size * layer1_size);
+	ReadParams(checkpoint_fin, sememe_vec2, sememe_size * layer1_size);
+	ReadParams(checkpoint_fin, sememe_vec_ada1, sememe_size * layer1_size);
+	ReadParams(checkpoint_fin, sememe_vec_ada2, sememe_size * layer1_size);
+	ReadParams(checkpoint_fin, sememe_bias, sememe_size);
+	ReadParams(checkpoint_fin, sememe_bias_ada, sememe_size);
+	ReadParams(checkpoint_fin, word_bias, hownet_size);
+	ReadParams(checkpoint_fin, word_bias_ada, hownet_size);
+	if (resume_header.tasks == 0)
+		fclose(checkpoint_fin);
+
+	word_count_actual = resume_header.word_count_actual;
+	seed = resume_header.seed;
+	// keep the learning rate schedule of the interrupted run
+	starting_alpha = resume_header.starting_alpha;
+	if (resume_header.num_epochs != NUM_EPOCHS)
+		fprintf(stderr, "WARNING: %s was written by a run with -epochs %lld\n", resume_file,
+		        resume_header.num_epochs);
+	NUM_EPOCHS = resume_header.num_epochs;
+}
+
+/* Row of word in matrix m (0 for syn0, 1 for syn1neg) as seen by the mono
+ * task t: its replica if the word is hot, otherwise @LoadRow with the
+ * buf-th row of t->row_bufs. Changes are kept by @MonoStore */
+static inline real *MonoRow(struct mono_task *t, int m, long long word, int buf) {
+	if (word < t->hot_n)
+		return t->hot[m] + word * layer1_size;
+	return LoadRow(m, t->lang_id, word, t->row_bufs + buf * layer1_size);
+}
+
+/* Writes back a row returned by @MonoRow */
+static inline void MonoStore(struct mono_task *t, int m, long long word, real *row) {
+	if (word >= t->hot_n)
+		StoreRow(m, t->lang_id, word, row);
+}
+
+/* AdaGrad accumulators of the row @MonoRow returns */
+static inline void *MonoGrads(struct mono_task *t, int m, long long word) {
+	if (adagrad && word < t->hot_n)
+		return t->hot_grads[m] + word * layer1_size;
+	return GradRow(m, t->lang_id, word);
+}
+
+/* Adds what the replicas of task t learned since the last merge to the
+ * shared rows, divided by the number of tasks of the language with
+ * HOT_MERGE_AVG (so that the shared row moves by the average of the
+ * replicas), and restarts the replicas from the shared rows. Accumulators
+ * always add up */
+void MergeHotRows(struct mono_task *t) {
+	long long i, word, n = t->hot_n * layer1_size;
+	real *shared, *shared_grads, scale = hot_merge_mode == HOT_MERGE_AVG ? 1.0 / num_threads : 1;
+	real *hot, *base;
+	int m, c;
+
+	for (m = 0; m < 2; m++) {
+		for (word = 0; word < t->hot_n; word++) {
+			shared = LoadRow(m, t->lang_id, word, t->row_bufs);
+			hot = t->hot[m] + word * layer1_size;
+			base = t->hot_base[m] + word * layer1_size;
+			for (c = 0; c < layer1_size; c++) {
+				shared[c] += (hot[c] - base[c]) * scale;
+				hot[c] = base[c] = shared[c];
 			}
+			StoreRow(m, t->lang_id, word, shared);
+		}
+		if (!adagrad)
+			continue;
+		shared_grads = (m ? syn1negGrads : syn0grads)[t->lang_id];
+		for (i = 0; i < n; i++) {
+			shared_grads[i] += t->hot_grads[m][i] - t->hot_grads_base[m][i];
+			t->hot_grads[m][i] = t->hot_grads_base[m][i] = shared_grads[i];
+		}
+	}
+	t->hot_words = 0;
+}
+
+/* Sets the -hot-rows replicas of t and their bases to the shared rows */
+void CopyHotRows(struct mono_task *t) {
+	long long word;
+	int m;
+
+	for (m = 0; m < 2; m++) {
+		for (word = 0; word < t->hot_n; word++)
+			memcpy(t->hot[m] + word * layer1_size, LoadRow(m, t->lang_id, word, t->row_bufs),
+			       layer1_size * sizeof(real));
+		memcpy(t->hot_base[m], t->hot[m], t->hot_n * layer1_size * sizeof(real));
+		if (adagrad) {
+			memcpy(t->hot_grads[m], (m ? syn1negGrads : syn0grads)[t->lang_id],
+			       t->hot_n * layer1_size * sizeof(real));
+			memcpy(t->hot_grads_base[m], t->hot_grads[m], t->hot_n * layer1_size * sizeof(real));
+		}
+	}
+}
+
+/* Sets up the monolingual training of language lang_id on the thread_id-th
+ * part of its corpus for one epoch */
+void InitMonoTask(struct mono_task *t, int lang_id, int thread_id) {
+	int m;
+
+	t->lang_id = lang_id;
+	t->thread_id = thread_id;
+	t->word_count = t->last_word_count = 0;
+	t->sentence_length = t->sentence_position = 0;
+	t->neu1 = calloc(layer1_size, sizeof(real));
+	t->neu1e = calloc(layer1_size, sizeof(real));
+	t->syn1negDelta = calloc(layer1_size, sizeof(real));
+	t->row_bufs = NULL;
+	if (param_precision == PRECISION_BF16)
+		t->row_bufs = malloc((2 * window + negative + 1) * layer1_size * sizeof(real));
+	t->batch_words = NULL;
+	t->batch_g = t->batch_e = NULL;
+	t->in_word = NULL;
+	if (fused_aux != 0)
+		t->in_word = calloc(sememe_size / 32 + 1, sizeof(unsigned int));
+	t->hot_n = hot_rows < vocab_sizes[lang_id] ? hot_rows : vocab_sizes[lang_id];
+	t->hot_words = 0;
+	for (m = 0; m < 2; m++) {
+		t->hot[m] = t->hot_base[m] = t->hot_grads[m] = t->hot_grads_base[m] = NULL;
+		if (t->hot_n == 0)
+			continue;
+		t->hot[m] = malloc(t->hot_n * layer1_size * sizeof(real));
+		t->hot_base[m] = malloc(t->hot_n * layer1_size * sizeof(real));
+		if (adagrad) {
+			t->hot_grads[m] = malloc(t->hot_n * layer1_size * sizeof(real));
+			t->hot_grads_base[m] = malloc(t->hot_n * layer1_size * sizeof(real));
+		}
+	}
+	// the replicas and their bases start as copies of the shared rows
+	if (t->hot_n > 0)
+		CopyHotRows(t);
+	if (hogbatch && !cbow) {
+		t->batch_words = malloc((2 * window + negative + 1) * sizeof(long long));
+		t->batch_g = malloc(2 * window * (negative + 1) * sizeof(real));
+		t->batch_e = malloc(2 * window * layer1_size * sizeof(real));
+	}
+	if (dump_every < 0) {
+		dump_every = max_train_words / abs(dump_every);
+	}
+	OpenReader(&t->reader, lang_id, thread_id);
+	ResetReader(&t->reader);
+	memset(&t->ring, 0, sizeof(struct sent_ring));
+	if (prefetch_readers > 0)
+		t->ring.batches = malloc(RING_SLOTS * sizeof(struct sent_batch));
+}
+
+/* Ends mono task t once its part of the epoch is done: merges its -hot-rows
+ * replicas and frees its buffers */
+void FreeMonoTask(struct mono_task *t) {
+	int m;
+
+	if (prefetch_readers == 0)
+		CloseReader(&t->reader);    // -readers: closed by RunEpoch
+	free(t->neu1);
+	free(t->neu1e);
+	free(t->syn1negDelta);
+	free(t->batch_words);
+	free(t->batch_g);
+	free(t->batch_e);
+	free(t->in_word);
+	if (t->hot_n > 0)
+		MergeHotRows(t);
+	free(t->row_bufs);
+	for (m = 0; m < 2; m++) {
+		free(t->hot[m]);
+		free(t->hot_base[m]);
+		free(t->hot_grads[m]);
+		free(t->hot_grads_base[m]);
+	}
+}
+
+/* Reader side of -readers: reads and subsamples sentences of mono task t into
+ * the next free batch of its ring. Returns 0 when the ring is full. A pass
+ * ends as in MonoModelStep without -readers, dropping the sentence read at
+ * the end of the corpus or past the word cap of the task */
+int FillRing(struct mono_task *t) {
+	struct sent_ring *q = &t->ring;
+	struct sent_batch *b;
+	int len;
+
+	if (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+		q->full_waits++;
+		return 0;
+	}
+	b = &q->batches[q->head % RING_SLOTS];
+	b->n = 0;
+	b->pass_end = 0;
+	while (b->n + MAX_SEN_LEN + 1 <= RING_BATCH) {
+		len = ReadSent(&t->reader, b->ids + b->n, &q->read_random);
+		q->read_words += len;
+		if (t->reader.eof || (t->reader.shards == NULL
+		                      && q->read_words > train_words[t->lang_id] / num_threads)) {
+			q->read_words = 0;
+			ResetReader(&t->reader);
+			b->pass_end = 1;
+			break;
+		}
+		if (len == 0)
+			continue;
+		b->n += len;
+		b->ids[b->n++] = 0;
+	}
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Trainer side of -readers: copies the next prefetched sentence of mono task t
+ * to sen and returns its length, or -1 at the end of a pass. Waits while the
+ * ring is empty */
+int PopSent(struct mono_task *t, int *sen) {
+	struct sent_ring *q = &t->ring;
+	struct sent_batch *b;
+	long long head;
+	int n = 0;
+
+	while (1) {
+		while ((head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) == q->tail) {
+			q->empty_waits++;
+			sched_yield();
+		}
+		b = &q->batches[q->tail % RING_SLOTS];
+		if (q->pos < b->n)
+			break;
+		q->pos = 0;
+		__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+		if (b->pass_end)
+			return -1;
+	}
+	q->occupancy += head - q->tail;
+	q->pops++;
+	while (b->ids[q->pos] != 0)
+		sen[n++] = b->ids[q->pos++];
+	q->pos++;
+	return n;
+}
+
+/* Adds the n updates a mono task made on lang_id since its last flush to
+ * lang_updates, and counts the epochs, dumps and checkpoints of every
+ * multiple the total went past. Checkpoints are written once the pool is
+ * stopped, see @PausePool */
+void FlushUpdates(int lang_id, long long n) {
+	long long before, after;
+	char save_name[MAX_STRING];
+
+	if (n == 0)
+		return;
+	before = __sync_fetch_and_add(&lang_updates[lang_id], n);
+	after = before + n;
+	if (after / max_train_words > before / max_train_words)
+		__sync_fetch_and_add(&epoch[lang_id], after / max_train_words - before / max_train_words);
+	if (dump_every > 0 && after / dump_every > before / dump_every) {
+		sprintf(save_name, output_files[lang_id], __sync_fetch_and_add(&dump_iters[lang_id], 1));
+		SaveModel(lang_id, save_name);
+	}
+	if (checkpoint_every > 0 && checkpoint_file[0] != 0 && lang_id == 0
+	        && after / checkpoint_every > before / checkpoint_every)
+		__atomic_store_n(&checkpoint_due, 1, __ATOMIC_RELEASE);
+}
+
+/* Skip-gram on one window as a minibatch (HogBatch): the nctx context words
+ * in t->batch_words share the nt targets that follow them, the center word
+ * and its negatives. The scores of all pairs are computed first; then every
+ * target row and every context row gets one update with its summed gradient,
+ * so each row is read from memory once per window instead of once per pair */
+void SkipGramBatch(struct mono_task *t, int nctx, int nt) {
+	long long *ctx = t->batch_words, *targets = t->batch_words + nctx;
+	real *g = t->batch_g, *e = t->batch_e, *delta = t->syn1negDelta, f, *row;
+	real *ctx_rows[nctx], *target_rows[nt];
+	int i, j, c;
+
+	for (i = 0; i < nctx; i++)
+		ctx_rows[i] = MonoRow(t, 0, ctx[i], i);
+	for (j = 0; j < nt; j++)
+		target_rows[j] = MonoRow(t, 1, targets[j], nctx + j);
+	// g = labels - sigmoid(ctx rows . target rows)
+	for (i = 0; i < nctx; i++)
+		for (j = 0; j < nt; j++) {
+			f = simd.dot(ctx_rows[i], target_rows[j], layer1_size);
+			// We multiply with the learning rate in UpdateRow()
+			if (f >= MAX_EXP)
+				f = 1;
+			else if (f < -MAX_EXP)
+				f = 0;
+			else
+				f = sigmoidTable[(int) ((f + MAX_EXP) / MAX_EXP / 2 * EXP_TABLE_SIZE)];
+			g[i * nt + j] = (j == 0) - f;
+		}
+	// e = g . target rows, before the targets move
+	for (i = 0; i < nctx; i++) {
+		for (c = 0; c < layer1_size; c++)
+			e[i * layer1_size + c] = 0;
+		for (j = 0; j < nt; j++) {
+			row = target_rows[j];
+			for (c = 0; c < layer1_size; c++)
+				e[i * layer1_size + c] += g[i * nt + j] * row[c];
 		}
-		src_entry++;
-	} // while training loop
-	//	fprintf(stderr, "Exiting matching thread %d. ALL_MONO_DONE = %d\n", (int)id, ALL_MONO_DONE);
-	pthread_exit(NULL);
-	return NULL;
+	}
+	// target j moves by g^T . ctx rows
+	for (j = 0; j < nt; j++) {
+		for (c = 0; c < layer1_size; c++)
+			delta[c] = 0;
+		for (i = 0; i < nctx; i++) {
+			row = ctx_rows[i];
+			for (c = 0; c < layer1_size; c++)
+				delta[c] += g[i * nt + j] * row[c];
+		}
+		UpdateRow(target_rows[j], MonoGrads(t, 1, targets[j]), layer1_size, delta, +1);
+		MonoStore(t, 1, targets[j], target_rows[j]);
+	}
+	for (i = 0; i < nctx; i++) {
+		UpdateRow(ctx_rows[i], MonoGrads(t, 0, ctx[i]), layer1_size, e + i * layer1_size, +1);
+		MonoStore(t, 0, ctx[i], ctx_rows[i]);
+	}
 }
 
-void SaveModel(int lang_id, char *name) {
-	long a, b;
-	struct vocab_word *vocab = vocabs[lang_id];
-	real *syn0 = syn0s[lang_id];
-	real *syn1neg = syn1negs[lang_id];
-	FILE *fo = fopen(name, "wb");
+/* -fused-aux: trains the lexicon entries of word of lang_id and, for a
+ * Chinese HowNet word, its sememes, while the rows of the word are still in
+ * cache from its monolingual update */
+void FusedAuxUpdate(struct mono_task *t, int lang_id, long long word,
+                    unsigned long long *next_random) {
+	long long i, e;
 
-	fprintf(stderr, "\nSaving model to file: %s\n", name);
-	fprintf(fo, "%lld %lld\n", vocab_sizes[lang_id], layer1_size);
-	for (a = 0; a < vocab_sizes[lang_id]; a++) {
-		fprintf(fo, "%s ", vocab[a].word);
-		if (binary) {
-			fprintf(stderr, "Not supported!\n");
-			//                      for (b = 0; b < layer1_size; b++)
-			//                              fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
-		} else
-			for (b = 0; b < layer1_size; b++)
-				fprintf(fo, "%lf ",
-				        syn0[a * layer1_size + b]
-				        + syn1neg[a * layer1_size + b]);  // 注意保存的是两套词向量的和
-		fprintf(fo, "\n");
+	for (i = lexicon_offsets[lang_id][word]; i < lexicon_offsets[lang_id][word + 1]; i++) {
+		e = lexicon_entries[lang_id][i];
+		LexiconUpdate(lexicons[0][e], lexicons[1][e], 0, 1, LEXICON_LAMBDA, t->syn1negDelta);
 	}
-	fclose(fo);
-}
-void SaveSememe() {
-	int a, b;
-	FILE *fo = fopen(save_sememe_file, "wb");
-	fprintf(stderr, "\nSaving sememe embeddings to file: %s\n", save_sememe_file);
-	fprintf(fo, "%lld %lld\n", sememe_size, layer1_size);
-	for (a = 0; a < sememe_size; a++) {
-		fprintf(fo, "%s ", sememes[a].word);
-		if (binary) {
-			fprintf(stderr, "Not supported!\n");
-			//                      for (b = 0; b < layer1_size; b++)
-			//                              fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
-		} else
-			for (b = 0; b < layer1_size; b++)
-				fprintf(fo, "%lf ",
-				        sememe_vec1[a * layer1_size + b]
-				        + sememe_vec2[a * layer1_size + b]);
-		fprintf(fo, "\n");
-	}
-	fclose(fo);
+	if (lang_id == 1 && vocab_hownet[word] != -1)
+		SememeWord(word, vocab_hownet[word], t->in_word, next_random);
 }
 
-/* Monolingual training thread */
-void *MonoModelThread(void *id) {
-	long long a, b, d, word, last_word, sentence_length = 0, sentence_position =
-	            0;
-	long long word_count = 0, last_word_count = 0, all_train_words = 0;
-	long long mono_sen[MAX_SEN_LEN + 1];
-	long long l1, l2, c, target, label;
-	int lang_id = (int) id / num_threads, thread_id = (int) id % num_threads, cw;
-	char *train_file = mono_train_files[lang_id];
-	long long vocab_size = vocab_sizes[lang_id];
+/* Monolingual training: continues the task t for at most budget words.
+ * The updates are counted locally and flushed once per call, so the tasks
+ * do not fight over the cache line of lang_updates on every word.
+ * Returns 1 when its part of the epoch is done */
+int MonoModelStep(struct mono_task *t, long long budget) {
+	long long a, b, d, word, last_word, sentence_length = t->sentence_length, sentence_position =
+	            t->sentence_position;
+	long long word_count = t->word_count, last_word_count = t->last_word_count, all_train_words = 0;
+	int *mono_sen = t->mono_sen, finished = 0;
+	long long c, target, label, steps = 0, updates = 0;
+	unsigned long long next_random = t->next_random;
+	int lang_id = t->lang_id, thread_id = t->thread_id, cw, nt;
 	real f, g;
 	clock_t now;
-	real *neu1 = calloc(layer1_size, sizeof(real));
-	real *neu1e = calloc(layer1_size, sizeof(real));
-	real *syn1neg = syn1negs[lang_id]; // 输出向量
-	real *syn1negDelta = calloc(layer1_size, sizeof(real));
-	real *syn0 = syn0s[lang_id]; // 输出向量
-	FILE *fi = fopen(train_file, "rb");
+	real *neu1 = t->neu1;
+	real *neu1e = t->neu1e;
+	real *in_row, *out_row;	// 输入向量, 输出向量 (-hot-rows: replicas of hot words)
+	real *syn1negDelta = t->syn1negDelta;
+	struct corpus_reader *reader = &t->reader;
 
 	if (!EARLY_STOP)
 		// If two languages have different amounts of training data,
@@ -1178,15 +4267,9 @@ void *MonoModelThread(void *id) {
 		all_train_words = EARLY_STOP;
 	}
 
-	if (dump_every < 0) {
-		dump_every = max_train_words / abs(dump_every);
-	}
-
-	fseek(fi, file_sizes[lang_id] / (long long) num_threads * thread_id,
-	      SEEK_SET);
-	while (1) {
+	while (steps++ < budget) {
 		if (word_count - last_word_count > 10000) {
-			word_count_actual += word_count - last_word_count; // word_count_actual为全局变量，记录各个线程的总训练词数
+			__sync_fetch_and_add(&word_count_actual, word_count - last_word_count); // word_count_actual为全局变量，记录各个线程的总训练词数
 			last_word_count = word_count;
 			if ((debug_mode > 1)) {
 				now = clock();
@@ -1214,31 +4297,34 @@ void *MonoModelThread(void *id) {
 			//			}
 		}
 		if (sentence_length == 0) { // 当前没有句子，则读取一个句子
-			sentence_length = ReadSent(fi, lang_id, mono_sen, 1);
-			word_count += sentence_length;
+			if (prefetch_readers > 0)
+				sentence_length = PopSent(t, mono_sen);	// -1 at the end of a pass
+			else
+				sentence_length = ReadSent(reader, mono_sen, &next_random);
+			if (sentence_length > 0)
+				word_count += sentence_length;
 			sentence_position = 0;
 		}
-		if (lang_updates[lang_id] > all_train_words / NUM_LANG) // 当前某语言的实时已训练词数已经大于两个语料中较大词数时，说明较大语料已经训练完成
-			break;  // 这是跳出while循环，结束该线程的主要出口
-
-		if (lang_updates[lang_id] > 0
-		        && lang_updates[lang_id] % max_train_words == 0) {
-			epoch[lang_id]++;
+		if (lang_updates[lang_id] + updates > all_train_words / NUM_LANG) { // 当前某语言的实时已训练词数已经大于两个语料中较大词数时，说明较大语料已经训练完成
+			finished = 1;
+			break;  // 这是跳出while循环，结束该任务的主要出口
 		}
 
-		if (feof(fi) || (word_count > train_words[lang_id] / num_threads)) {  // 当前线程训练词数已经超过平均训练词数
-			word_count_actual += word_count - last_word_count;
+		if (prefetch_readers > 0 ? sentence_length < 0 : reader->eof
+		    || (reader->shards == NULL && word_count > train_words[lang_id] / num_threads)) {  // 当前线程训练词数已经超过平均训练词数
+			__sync_fetch_and_add(&word_count_actual, word_count - last_word_count);
 			word_count = 0;
 			last_word_count = 0;
 			sentence_length = 0;
-			fseek(fi, file_sizes[lang_id] / (long long) num_threads * thread_id, // 从头开始继续训练
-			      SEEK_SET);
+			if (prefetch_readers == 0)
+				ResetReader(reader); // 从头开始继续训练
 			continue;
 		}
 		if (EARLY_STOP) {
 			if (word_count_actual > EARLY_STOP) {
 				fprintf(stderr, "EARLY STOP point reached (thread %d)\n",
-				        (int) id);
+				        lang_id * num_threads + thread_id);
+				finished = 1;
 				break;
 			}
 		}
@@ -1267,8 +4353,9 @@ void *MonoModelThread(void *id) {
 					last_word = mono_sen[c];// 找到c对应的索引
 					if (last_word == -1) continue; //之前已经判断过不要把不在词库的词加入
 
+					in_row = MonoRow(t, 0, last_word, 0);
 					for (c = 0; c < layer1_size; c++)
-						neu1[c] += syn0[c + last_word * layer1_size];// 把各个周围词向量累加
+						neu1[c] += in_row[c];// 把各个周围词向量累加
 					cw++;
 				}
 			if (cw) {  //周围词数大于0，开始计算梯度并更新
@@ -1281,19 +4368,13 @@ void *MonoModelThread(void *id) {
 						label = 1;
 					} else
 					{
-						next_random = next_random * (unsigned long long) 25214903917
-						              + 11;
-						target = tables[lang_id][(next_random >> 16) % table_size];
-						if (target == 0) // 选出</S>，则重新选
-							target = next_random % (vocab_size - 1) + 1;
+						target = DrawNegative(lang_id, &next_random);
 						if (target == word) continue; //选出正样本，则重新选
 						label = 0;
 					}
-					l2 = target * layer1_size;  // 选出的样本词的词向量偏置
-					f = 0;
-					for (c = 0; c < layer1_size; c++)
-						f += neu1[c] * syn1neg[c + l2];
-					// learning rate alpha is applied in UpdateEmbeddings()
+					out_row = MonoRow(t, 1, target, 1);  // 选出的样本词的词向量
+					f = simd.dot(neu1, out_row, layer1_size);
+					// learning rate alpha is applied in UpdateRow()
 					if (f >= MAX_EXP)
 						g = (label - 1);
 					else if (f < -MAX_EXP)
@@ -1303,13 +4384,14 @@ void *MonoModelThread(void *id) {
 						     - sigmoidTable[(int) ((f + MAX_EXP) / MAX_EXP / 2 * EXP_TABLE_SIZE)]);
 
 					for (c = 0; c < layer1_size; c++)
-						neu1e[c] += g * syn1neg[c + l2];
+						neu1e[c] += g * out_row[c];
 
 					//for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * neu1[c];
 					for (c = 0; c < layer1_size; c++)
 						syn1negDelta[c] = neu1[c] * g; // syn1neg的变化量
-					UpdateEmbeddings(syn1neg, syn1negGrads[lang_id], l2,
-					                 layer1_size, syn1negDelta, +1); // 修改负采样方法中的逻辑回归的参数
+					UpdateRow(out_row, MonoGrads(t, 1, target), layer1_size,
+					          syn1negDelta, +1); // 修改负采样方法中的逻辑回归的参数
+					MonoStore(t, 1, target, out_row);
 				}
 				// hidden -> in 修改词向量
 				for (a = b; a < window * 2 + 1 - b; a++)
@@ -1321,10 +4403,31 @@ void *MonoModelThread(void *id) {
 						if (last_word == -1)  continue;
 						//for (c = 0; c < layer1_size; c++)
 						//syn0[c + last_word * layer1_size] += neu1e[c];
-						UpdateEmbeddings(syn0, syn0grads[lang_id],
-						                 last_word * layer1_size, layer1_size, neu1e, +1);
+						in_row = MonoRow(t, 0, last_word, 0);
+						UpdateRow(in_row, MonoGrads(t, 0, last_word), layer1_size, neu1e, +1);
+						MonoStore(t, 0, last_word, in_row);
 					}
 			}
+		} else if (hogbatch) {
+			// SKIPGRAM ON THE WHOLE WINDOW, WITH SHARED NEGATIVES
+			cw = 0;
+			for (a = b; a < window * 2 + 1 - b; a++)
+				if (a != window) {
+					c = sentence_position - window + a;
+					if (c < 0 || c >= sentence_length || mono_sen[c] == -1)
+						continue;
+					t->batch_words[cw++] = mono_sen[c];
+				}
+			if (cw) {
+				nt = 0;
+				t->batch_words[cw + nt++] = word;
+				for (d = 0; d < negative; d++) {
+					target = DrawNegative(lang_id, &next_random);
+					if (target != word)
+						t->batch_words[cw + nt++] = target;
+				}
+				SkipGramBatch(t, cw, nt);
+			}
 		} else {
 			// SKIPGRAM ARCHITECTURE WITH NEGATIVE SAMPLING
 			// Zm: This does not seem to be consistent with the paper.
@@ -1340,7 +4443,7 @@ void *MonoModelThread(void *id) {
 					last_word = mono_sen[c];
 					if (last_word == -1)
 						continue;
-					l1 = last_word * layer1_size;  // 当前周围词的词向量存储偏置
+					in_row = MonoRow(t, 0, last_word, 0);  // 当前周围词的词向量
 					for (c = 0; c < layer1_size; c++)
 						neu1e[c] = 0;
 					// NEGATIVE SAMPLING
@@ -1349,21 +4452,14 @@ void *MonoModelThread(void *id) {
 							target = word;
 							label = 1;
 						} else {
-							next_random = next_random
-							              * (unsigned long long) 25214903917 + 11;
-							target = tables[lang_id][(next_random >> 16)
-							                         % table_size];
-							if (target == 0)
-								target = next_random % (vocab_size - 1) + 1;
+							target = DrawNegative(lang_id, &next_random);
 							if (target == word)
 								continue;
 							label = 0;
 						}
-						l2 = target * layer1_size; // 负采样词的偏置
-						f = 0;
-						for (c = 0; c < layer1_size; c++)
-							f += syn0[c + l1] * syn1neg[c + l2];
-						// We multiply with the learning rate in UpdateEmbeddings()
+						out_row = MonoRow(t, 1, target, 1); // 负采样词的向量
+						f = simd.dot(in_row, out_row, layer1_size);
+						// We multiply with the learning rate in UpdateRow()
 						if (f >= MAX_EXP)
 							g = (label - 1);
 						else if (f < -MAX_EXP)
@@ -1372,65 +4468,620 @@ void *MonoModelThread(void *id) {
 							g = (label
 							     - sigmoidTable[(int) ((f + MAX_EXP) / MAX_EXP / 2 * EXP_TABLE_SIZE)]);
 						for (c = 0; c < layer1_size; c++)
-							neu1e[c] += g * syn1neg[c + l2];
+							neu1e[c] += g * out_row[c];
 						//for (c = 0; c < layer1_size; c++)
 						//syn1neg[c + l2] += g * syn0[c + l1];
 						for (c = 0; c < layer1_size; c++)
-							syn1negDelta[c] = g * syn0[c + l1];
-						UpdateEmbeddings(syn1neg, syn1negGrads[lang_id], l2,  // 更新参数
-						                 layer1_size, syn1negDelta, +1);
+							syn1negDelta[c] = g * in_row[c];
+						UpdateRow(out_row, MonoGrads(t, 1, target), layer1_size,  // 更新参数
+						          syn1negDelta, +1);
+						MonoStore(t, 1, target, out_row);
 					}
 					// Learn weights input -> hidden
 					//for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
-					UpdateEmbeddings(syn0, syn0grads[lang_id], l1, layer1_size,
-					                 neu1e, +1); // 更新词向量
+					UpdateRow(in_row, MonoGrads(t, 0, last_word), layer1_size,
+					          neu1e, +1); // 更新词向量
+					MonoStore(t, 0, last_word, in_row);
 				}
 			}   // for
 		}   // skipgram
-		lang_updates[lang_id]++;
-		sentence_position++;
-		if (dump_every > 0) {
-			if (lang_updates[lang_id] % dump_every == 0) {
-				char save_name[MAX_STRING];
-				sprintf(save_name, output_files[lang_id],
-				        dump_iters[lang_id]++);
-				SaveModel(lang_id, save_name);
-			}
+		if (fused_aux != 0 && fused_keeps[lang_id][word] != 0) {
+			next_random = next_random * (unsigned long long) 25214903917 + 11;
+			if ((unsigned int) (next_random >> 16) < fused_keeps[lang_id][word])
+				FusedAuxUpdate(t, lang_id, word, &next_random);
 		}
+		if (t->hot_n > 0 && ++t->hot_words >= hot_merge)
+			MergeHotRows(t);
+		updates++;
+		sentence_position++;
 		if (sentence_position >= sentence_length) {
 			sentence_length = 0;
 			continue;
 		}
 	}
-	fclose(fi);
-	free(neu1);
-	free(neu1e);
-	MONO_DONE_TRAINING++; // 已结束训练线程数
-	pthread_exit(NULL);
-	return NULL;
+	FlushUpdates(lang_id, updates);
+	t->word_count = word_count;
+	t->last_word_count = last_word_count;
+	t->sentence_length = sentence_length;
+	t->sentence_position = sentence_position;
+	t->next_random = next_random;
+	if (finished)
+		FreeMonoTask(t);
+	return finished;
 }
 
 void InitLexiconWords() {
 	int a, i, srcEntry, tgtEntry;
+	real src_buf[layer1_size], tgt_buf[layer1_size], *src, *tgt;
 	for (i = 0; i < lexicon_size; i++) {
 		srcEntry = lexicons[0][i];
 		tgtEntry = lexicons[1][i];
+		src = LoadRow(0, 0, srcEntry, src_buf);
+		tgt = LoadRow(0, 1, tgtEntry, tgt_buf);
 		for (a = 0; a < layer1_size; a++) {
-			syn0s[1][tgtEntry * layer1_size + a] = syn0s[0][srcEntry * layer1_size + a];
+			tgt[a] = src[a];
+		}
+		StoreRow(0, 1, tgtEntry, tgt);
+	}
+}
+
+// The training threads: a pool of num_threads workers that lives across
+// epochs. Every objective is split into tasks, one per language and part of
+// the corpus for the monolingual objective and one per part of the lexicon
+// or vocabulary for the others. A worker runs a task for one quantum and
+// then picks the next: it gives every objective a share of its time
+// proportional to task_weights (stride scheduling on the time spent), tries
+// its own part first and otherwise steals any free task of that objective
+#define TASK_MONO 0
+#define TASK_LEXICON 1
+#define TASK_SEMEME 2
+#define TASK_MATCH_T2S 3
+#define TASK_MATCH_S2T 4
+#define TASK_KINDS 5
+#define MONO_QUANTUM 256	// words per step of a mono task
+#define LEXICON_QUANTUM 256	// lexicon entries per step
+#define SEMEME_QUANTUM 64	// Chinese words per step
+#define MATCH_QUANTUM 1		// blocks of MATCH_BLOCK words per step
+struct train_task {
+	char busy;	// claimed by a worker
+	char done;	// mono only: its part of the epoch is trained
+	// a cache line of its own, so that the state a worker writes on every
+	// word never shares one with the flags or the state of another task
+	union {
+		struct mono_task mono;
+		struct aux_task aux;
+	} __attribute__((aligned(64)));
+};
+struct train_task *pool_tasks[TASK_KINDS];
+int pool_task_counts[TASK_KINDS];
+real task_weights[TASK_KINDS] = {2, 1, 1, 1, 1};
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER, pool_finished = PTHREAD_COND_INITIALIZER;
+long long pool_generation = 0;	// epochs started
+int pool_idle = 0;		// workers done with the current epoch
+char pool_exit = 0;
+int pool_paused = 0;		// workers stopped in @PausePool
+long long pause_generation = 0;	// pauses of the pool so far
+pthread_cond_t pool_resume = PTHREAD_COND_INITIALIZER;
+// -deterministic: turns of the objectives, see @RunEpochDeterministic
+double det_pass[TASK_KINDS];
+int det_next[TASK_KINDS];
+
+/* Writes the state of every task of the epoch after the parameters of a
+ * mid-epoch checkpoint, while none of them runs. The sentence a mono task
+ * is in goes with it, so that the task continues at the same word, and so
+ * do the rows matching searches until the next @RefreshMatchCache */
+void WriteTasks(FILE *fo) {
+	struct checkpoint_task state;
+	struct train_task *t;
+	struct mono_task *m;
+	struct match_cache *cache;
+	int kind, a, lang_id;
+
+	for (kind = 0; kind < TASK_KINDS; kind++)
+		for (a = 0; a < pool_task_counts[kind]; a++) {
+			t = &pool_tasks[kind][a];
+			memset(&state, 0, sizeof(state));
+			state.done = t->done;
+			if (kind != TASK_MONO) {
+				state.entry = t->aux.entry;
+				state.next_random = t->aux.next_random;
+			} else if (!t->done) {
+				m = &t->mono;
+				state.eof = m->reader.eof;
+				state.shard = m->reader.shard;
+				state.offset = ReaderOffset(&m->reader);
+				state.word_count = m->word_count;
+				state.last_word_count = m->last_word_count;
+				state.sentence_length = m->sentence_length;
+				state.sentence_position = m->sentence_position;
+				state.next_random = m->next_random;
+				memcpy(state.sen, m->mono_sen, sizeof(state.sen));
+			}
+			fwrite(&state, sizeof(state), 1, fo);
+		}
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		cache = &match_caches[lang_id];
+		fwrite(cache->vecs, sizeof(real), cache->size * layer1_size, fo);
+		fwrite(cache->inv_norms, sizeof(real), cache->size, fo);
+		fwrite(match_memos[lang_id], sizeof(struct match_memo), vocab_sizes[lang_id], fo);
+	}
+	fwrite(det_pass, sizeof(det_pass), 1, fo);
+	fwrite(det_next, sizeof(det_next), 1, fo);
+	fwrite(&round_step, sizeof(round_step), 1, fo);
+}
+
+/* Writes the whole training state to checkpoint_file, so that training can
+ * resume at the beginning of epoch ep or, with mid_epoch, where the tasks of
+ * the epoch are now (see @WriteTasks). The file is written under a temporary
+ * name and renamed, so an interrupted write never replaces the last good
+ * checkpoint */
+void SaveCheckpoint(long long ep, int mid_epoch) {
+	struct checkpoint_header header;
+	char tmp_file[MAX_STRING + 8];
+	int lang_id, kind;
+	FILE *fo;
+
+	sprintf(tmp_file, "%s.tmp", checkpoint_file);
+	fo = fopen(tmp_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s for writing!\n", tmp_file);
+		exit(1);
+	}
+	fprintf(stderr, "\nSaving checkpoint to file: %s\n", checkpoint_file);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CLSPCKP", 8);
+	header.version = CHECKPOINT_VERSION;
+	header.adagrad = adagrad;
+	header.threads = num_threads;
+	if (mid_epoch)
+		for (kind = 0; kind < TASK_KINDS; kind++)
+			header.tasks += pool_task_counts[kind];
+	header.layer1_size = layer1_size;
+	header.sememe_size = sememe_size;
+	header.hownet_size = hownet_size;
+	header.epoch = ep;
+	header.num_epochs = NUM_EPOCHS;
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		header.lang_updates[lang_id] = mid_epoch ? lang_updates[lang_id] : 0;
+		header.epochs[lang_id] = epoch[lang_id];
+		header.dump_iters[lang_id] = dump_iters[lang_id];
+	}
+	header.word_count_actual = word_count_actual;
+	header.seed = seed;
+	header.starting_alpha = starting_alpha;
+	fwrite(&header, sizeof(header), 1, fo);
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++)
+		WriteVocabBinary(lang_id, fo);
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		WriteStored(fo, ParamMatrix(0, lang_id), vocab_sizes[lang_id] * layer1_size, param_precision);
+		WriteStored(fo, ParamMatrix(1, lang_id), vocab_sizes[lang_id] * layer1_size, param_precision);
+		if (adagrad) {
+			WriteStored(fo, syn0grads[lang_id], vocab_sizes[lang_id] * layer1_size, grad_precision);
+			WriteStored(fo, syn1negGrads[lang_id], vocab_sizes[lang_id] * layer1_size, grad_precision);
+		}
+	}
+	WriteParams(fo, sememe_vec1, sememe_size * layer1_size);
+	WriteParams(fo, sememe_vec2, sememe_size * layer1_size);
+	WriteParams(fo, sememe_vec_ada1, sememe_size * layer1_size);
+	WriteParams(fo, sememe_vec_ada2, sememe_size * layer1_size);
+	WriteParams(fo, sememe_bias, sememe_size);
+	WriteParams(fo, sememe_bias_ada, sememe_size);
+	WriteParams(fo, word_bias, hownet_size);
+	WriteParams(fo, word_bias_ada, hownet_size);
+	if (mid_epoch)
+		WriteTasks(fo);
+
+	if (fflush(fo) != 0 || fsync(fileno(fo)) != 0 || ferror(fo)) {
+		printf("ERROR: writing %s failed!\n", tmp_file);
+		exit(1);
+	}
+	fclose(fo);
+	if (rename(tmp_file, checkpoint_file) != 0) {
+		printf("ERROR: cannot rename %s to %s!\n", tmp_file, checkpoint_file);
+		exit(1);
+	}
+}
+
+/* Writes the checkpoint of -checkpoint-every while no task runs. The
+ * replicas of -hot-rows are merged first, so that the file has what they
+ * learned, and then all start again from the merged rows, as they do in
+ * the run that resumes from the file */
+void CheckpointPool() {
+	struct mono_task *t;
+	int a;
+
+	for (a = 0; a < pool_task_counts[TASK_MONO]; a++) {
+		t = &pool_tasks[TASK_MONO][a].mono;
+		if (!pool_tasks[TASK_MONO][a].done && t->hot_n > 0)
+			MergeHotRows(t);
+	}
+	for (a = 0; a < pool_task_counts[TASK_MONO]; a++) {
+		t = &pool_tasks[TASK_MONO][a].mono;
+		if (!pool_tasks[TASK_MONO][a].done && t->hot_n > 0)
+			CopyHotRows(t);
+	}
+	SaveCheckpoint(train_epoch, 1);
+}
+
+/* Stops a worker between two quanta while a checkpoint is due. The last
+ * worker to stop writes it and lets the others go on. Once all mono tasks
+ * are done nothing is written, since the checkpoint of the epoch end
+ * follows */
+void PausePool() {
+	long long generation;
+
+	pthread_mutex_lock(&pool_mutex);
+	generation = pause_generation;
+	if (++pool_paused == num_threads) {
+		if (!__atomic_load_n(&ALL_MONO_DONE, __ATOMIC_ACQUIRE))
+			CheckpointPool();
+		pool_paused = 0;
+		__atomic_store_n(&checkpoint_due, 0, __ATOMIC_RELEASE);
+		pause_generation++;
+		pthread_cond_broadcast(&pool_resume);
+	} else
+		while (pause_generation == generation && !__atomic_load_n(&ALL_MONO_DONE, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&pool_resume, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Runs one quantum of task t */
+void RunTask(int kind, struct train_task *t) {
+	switch (kind) {
+	case TASK_MONO:
+		if (MonoModelStep(&t->mono, MONO_QUANTUM)) {
+			t->done = 1;
+			if (__sync_add_and_fetch(&MONO_DONE_TRAINING, 1) == pool_task_counts[TASK_MONO])
+				__atomic_store_n(&ALL_MONO_DONE, 1, __ATOMIC_RELEASE);
+		}
+		break;
+	case TASK_LEXICON:
+		LexiconStep(&t->aux, LEXICON_QUANTUM);
+		break;
+	case TASK_SEMEME:
+		SememeStep(&t->aux, SEMEME_QUANTUM);
+		break;
+	default:
+		MatchingStep(&t->aux, MATCH_QUANTUM);
+	}
+}
+
+/* Claims a task of kind for worker: its own part first (for mono, of the
+ * language given by turn), then the next free one. Returns NULL if all
+ * tasks of kind are done or taken */
+struct train_task *ClaimTask(int kind, int worker, int turn) {
+	int n = pool_task_counts[kind], a, first;
+	struct train_task *t;
+
+	first = kind == TASK_MONO ? worker + turn % NUM_LANG * num_threads : worker;
+	for (a = 0; a < n; a++) {
+		t = &pool_tasks[kind][(first + a) % n];
+		if (t->done || __atomic_load_n(&t->busy, __ATOMIC_RELAXED))
+			continue;
+		if (__sync_lock_test_and_set(&t->busy, 1) == 0) {
+			if (!t->done)
+				return t;
+			__sync_lock_release(&t->busy);
+		}
+	}
+	return NULL;
+}
+
+/* Worker of the pool: trains an epoch every time TrainModel starts one */
+void *PoolWorker(void *id) {
+	int worker = (long long) id, kind, k, turn = 0;
+	long long generation = 0;
+	double pass[TASK_KINDS];
+	char skip[TASK_KINDS];
+	struct train_task *t;
+	struct timespec t0, t1;
+
+	while (1) {
+		pthread_mutex_lock(&pool_mutex);
+		while (pool_generation == generation && !pool_exit)
+			pthread_cond_wait(&pool_start, &pool_mutex);
+		generation = pool_generation;
+		if (pool_exit) {
+			pthread_mutex_unlock(&pool_mutex);
+			break;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+
+		for (k = 0; k < TASK_KINDS; k++)
+			pass[k] = 0;
+		while (1) {
+			if (__atomic_load_n(&checkpoint_due, __ATOMIC_ACQUIRE))
+				PausePool();
+			if (__atomic_load_n(&ALL_MONO_DONE, __ATOMIC_ACQUIRE))
+				break;
+			// the objective with the least weighted time that has a free task
+			memset(skip, 0, sizeof(skip));
+			t = NULL;
+			while (t == NULL) {
+				kind = -1;
+				for (k = 0; k < TASK_KINDS; k++)
+					if (!skip[k] && task_weights[k] > 0 && (kind == -1 || pass[k] < pass[kind]))
+						kind = k;
+				if (kind == -1)
+					break;
+				t = ClaimTask(kind, worker, turn++);
+				if (t == NULL)
+					skip[kind] = 1;
+			}
+			if (t == NULL) {
+				sched_yield();  // the last mono tasks are running elsewhere
+				continue;
+			}
+			// an objective that had no free task is not owed the time it missed
+			for (k = 0; k < TASK_KINDS; k++)
+				if (skip[k] && pass[k] < pass[kind])
+					pass[k] = pass[kind];
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			RunTask(kind, t);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			__sync_lock_release(&t->busy);
+			pass[kind] += ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9) / task_weights[kind];
+		}
+
+		pthread_mutex_lock(&pool_mutex);
+		if (++pool_idle == num_threads)
+			pthread_cond_signal(&pool_finished);
+		pthread_cond_broadcast(&pool_resume);	// workers in @PausePool stop waiting
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/* Random state of the index-th task of kind in epoch ep: a splitmix64 hash
+ * of seed, so that every task draws from its own stream */
+unsigned long long TaskSeed(int kind, int index, long long ep) {
+	unsigned long long x = seed + 0x9E3779B97F4A7C15ULL * (((ep * TASK_KINDS + kind) << 20) + index + 1);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* Sets up the tasks of an epoch, each starting at the beginning of its part */
+void InitEpochTasks() {
+	int a, b, s, kind, lang_id;
+	unsigned long long next_random;
+	struct train_task *t;
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++)
+		if (sent_index > 1 && shard_orders[lang_id] != NULL) {
+			// a new order of the shards in every epoch, which depends on the
+			// epoch only, so that a -resume reads them in the same order
+			next_random = TaskSeed(TASK_MONO, pool_task_counts[TASK_MONO] + lang_id, train_epoch);
+			for (a = 0; a < shard_counts[lang_id]; a++)
+				shard_orders[lang_id][a] = a;
+			for (a = shard_counts[lang_id] - 1; a > 0; a--) {
+				next_random = next_random * (unsigned long long) 25214903917 + 11;
+				b = (next_random >> 16) % (a + 1);
+				s = shard_orders[lang_id][a];
+				shard_orders[lang_id][a] = shard_orders[lang_id][b];
+				shard_orders[lang_id][b] = s;
+			}
+		}
+	for (kind = 0; kind < TASK_KINDS; kind++)
+		for (a = 0; a < pool_task_counts[kind]; a++) {
+			t = &pool_tasks[kind][a];
+			t->busy = t->done = 0;
+			if (kind == TASK_MONO) {
+				InitMonoTask(&t->mono, a / num_threads, a % num_threads);
+				t->mono.next_random = TaskSeed(kind, a, train_epoch);
+				t->mono.ring.read_random = TaskSeed(kind, pool_task_counts[kind] + NUM_LANG + a, train_epoch);
+				continue;
+			}
+			memset(&t->aux, 0, sizeof(t->aux));
+			t->aux.thread_id = a;
+			if (kind == TASK_LEXICON)
+				t->aux.entry = lexicon_size / num_threads * a; // 各个任务读词表的起始位置
+			else if (kind == TASK_SEMEME) {
+				t->aux.entry = hownet_word_count * a / num_threads;
+				t->aux.next_random = TaskSeed(kind, a, train_epoch);
+				t->aux.in_word = calloc(sememe_size / 32 + 1, sizeof(unsigned int));
+			} else {
+				t->aux.lang_id = kind == TASK_MATCH_T2S ? 1 : 0;
+				t->aux.entry = vocab_sizes[t->aux.lang_id] / num_threads * a;
+				t->aux.q = malloc(MATCH_BLOCK * layer1_size * sizeof(real));
+			}
+		}
+}
+
+void FreeEpochTasks() {
+	int a, kind;
+	for (a = 0; a < pool_task_counts[TASK_MONO]; a++) {
+		if (prefetch_readers > 0)
+			CloseReader(&pool_tasks[TASK_MONO][a].mono.reader);
+		free(pool_tasks[TASK_MONO][a].mono.ring.batches);
+	}
+	for (kind = TASK_LEXICON; kind < TASK_KINDS; kind++)
+		for (a = 0; a < pool_task_counts[kind]; a++) {
+			free(pool_tasks[kind][a].aux.in_word);
+			free(pool_tasks[kind][a].aux.q);
+		}
+}
+
+/* Puts the tasks of the first epoch of a -resume where a mid-epoch
+ * checkpoint left them, see @WriteTasks */
+void RestoreTasks() {
+	struct checkpoint_task state;
+	struct train_task *t;
+	struct mono_task *m;
+	struct match_cache *cache;
+	int kind, a, lang_id;
+
+	for (kind = 0; kind < TASK_KINDS; kind++)
+		for (a = 0; a < pool_task_counts[kind]; a++) {
+			if (fread(&state, sizeof(state), 1, checkpoint_fin) != 1) {
+				printf("ERROR: %s is truncated!\n", resume_file);
+				exit(1);
+			}
+			t = &pool_tasks[kind][a];
+			if (kind != TASK_MONO) {
+				t->aux.entry = state.entry;
+				t->aux.next_random = state.next_random;
+				continue;
+			}
+			m = &t->mono;
+			if (state.done) {
+				t->done = 1;
+				MONO_DONE_TRAINING++;
+				FreeMonoTask(m);
+				continue;
+			}
+			SeekReader(&m->reader, state.shard, state.offset);
+			m->reader.eof = state.eof;
+			m->word_count = state.word_count;
+			m->last_word_count = state.last_word_count;
+			m->sentence_length = state.sentence_length;
+			m->sentence_position = state.sentence_position;
+			m->next_random = state.next_random;
+			memcpy(m->mono_sen, state.sen, sizeof(state.sen));
+		}
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		cache = &match_caches[lang_id];
+		if (fread(cache->vecs, sizeof(real), cache->size * layer1_size, checkpoint_fin) != cache->size * layer1_size
+		        || fread(cache->inv_norms, sizeof(real), cache->size, checkpoint_fin) != cache->size
+		        || fread(match_memos[lang_id], sizeof(struct match_memo), vocab_sizes[lang_id], checkpoint_fin)
+		           != vocab_sizes[lang_id]) {
+			printf("ERROR: %s is truncated!\n", resume_file);
+			exit(1);
+		}
+	}
+	if (fread(det_pass, sizeof(det_pass), 1, checkpoint_fin) != 1
+	        || fread(det_next, sizeof(det_next), 1, checkpoint_fin) != 1
+	        || fread(&round_step, sizeof(round_step), 1, checkpoint_fin) != 1) {
+		printf("ERROR: %s is truncated!\n", resume_file);
+		exit(1);
+	}
+	fclose(checkpoint_fin);
+	resume_header.tasks = 0;
+}
+
+/* Trains one epoch with -deterministic: the tasks run one quantum at a time
+ * on the calling thread, the objectives taking turns by quanta instead of
+ * time and the tasks of an objective in a fixed round robin */
+void RunEpochDeterministic() {
+	double *pass = det_pass;
+	int *next = det_next, kind, k, a, n;
+	struct train_task *t;
+
+	while (!ALL_MONO_DONE) {
+		kind = -1;
+		for (k = 0; k < TASK_KINDS; k++)
+			if (task_weights[k] > 0 && (kind == -1 || pass[k] < pass[kind]))
+				kind = k;
+		n = pool_task_counts[kind];
+		for (a = 0; a < n; a++) {
+			t = &pool_tasks[kind][(next[kind] + a) % n];
+			if (!t->done) {
+				next[kind] = (next[kind] + a + 1) % n;
+				RunTask(kind, t);
+				break;
+			}
+		}
+		pass[kind] += 1 / task_weights[kind];
+		if (checkpoint_due && !ALL_MONO_DONE)
+			CheckpointPool();
+		checkpoint_due = 0;
+	}
+}
+
+/* Reader thread id of -readers: keeps the rings of mono tasks id, id + readers,
+ * ... filled until all mono tasks of the epoch are done */
+void *ReaderThread(void *id) {
+	int a, filled;
+	struct train_task *t;
+	struct timespec idle = {0, 100000};
+
+	while (!__atomic_load_n(&ALL_MONO_DONE, __ATOMIC_ACQUIRE)) {
+		filled = 0;
+		for (a = (long) id; a < pool_task_counts[TASK_MONO]; a += prefetch_readers) {
+			t = &pool_tasks[TASK_MONO][a];
+			if (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE))
+				filled += FillRing(&t->mono);
+		}
+		if (!filled)
+			nanosleep(&idle, NULL);  // all rings full: the trainers are the bottleneck
+	}
+	return NULL;
+}
+
+/* Prints how full the rings of -readers were during the epoch. Rings that
+ * are mostly empty mean the trainers wait for the corpus and more readers
+ * help; rings that are mostly full mean training is compute bound */
+void ReportPrefetch() {
+	long long occupancy, pops, empty_waits, full_waits;
+	int a, lang_id;
+	struct sent_ring *q;
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		occupancy = pops = empty_waits = full_waits = 0;
+		for (a = lang_id * num_threads; a < (lang_id + 1) * num_threads; a++) {
+			q = &pool_tasks[TASK_MONO][a].mono.ring;
+			occupancy += q->occupancy;
+			pops += q->pops;
+			empty_waits += q->empty_waits;
+			full_waits += q->full_waits;
 		}
+		fprintf(stderr, "Prefetch L%d: %.2f of %d batches queued per sentence, "
+		        "%lld waits on an empty ring, %lld on a full ring (%s bound)\n",
+		        lang_id + 1, occupancy / (real) (pops + 1), RING_SLOTS, empty_waits, full_waits,
+		        empty_waits > full_waits ? "reader" : "trainer");
+	}
+}
+
+/* Trains one epoch on the pool and waits until all workers are done */
+void RunEpoch() {
+	pthread_t *reader_pt = malloc(prefetch_readers * sizeof(pthread_t));
+	long a;
+
+	InitEpochTasks();
+	MONO_DONE_TRAINING = 0;
+	ALL_MONO_DONE = 0;
+	checkpoint_due = 0;
+	pool_paused = 0;
+	memset(det_pass, 0, sizeof(det_pass));
+	memset(det_next, 0, sizeof(det_next));
+	// like the pool workers, which are new threads each epoch, so that a
+	// -resume rounds to bf16 as the interrupted run did with -deterministic
+	round_step = 0;
+	if (resume_header.tasks > 0)
+		RestoreTasks();
+	for (a = 0; a < prefetch_readers; a++)
+		pthread_create(&reader_pt[a], NULL, ReaderThread, (void *) a);
+	if (deterministic)
+		RunEpochDeterministic();
+	else {
+		pthread_mutex_lock(&pool_mutex);
+		pool_idle = 0;
+		pool_generation++;
+		pthread_cond_broadcast(&pool_start);
+		while (pool_idle < num_threads)
+			pthread_cond_wait(&pool_finished, &pool_mutex);
+		pthread_mutex_unlock(&pool_mutex);
 	}
+	for (a = 0; a < prefetch_readers; a++)
+		pthread_join(reader_pt[a], NULL);
+	if (prefetch_readers > 0 && debug_mode > 0)
+		ReportPrefetch();
+	FreeEpochTasks();
+	free(reader_pt);
 }
 
 void TrainModel() {
 	long a;
 	int lang_id, i;
-	pthread_t *mono_pt = malloc(NUM_LANG * num_threads * sizeof(pthread_t)); // 单语言训练线程
-	pthread_t *lexicon_pt = malloc(num_threads * sizeof(pthread_t));
-	pthread_t *sememe_pt = malloc(num_threads * sizeof(pthread_t));
-	pthread_t *matching_t2s_pt = malloc(num_threads * sizeof(pthread_t));
-	pthread_t *matching_s2t_pt = malloc(num_threads * sizeof(pthread_t));
+	pthread_t *pool_pt = malloc(num_threads * sizeof(pthread_t)); // 训练线程池
+	pthread_t ivf_pt;
 	starting_alpha = alpha;
 
+	SelectSimdKernels();
+	srand(seed);    // the initial vectors
 	expTable = malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
 	sigmoidTable = malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
 	for (i = 0; i < EXP_TABLE_SIZE; i++) {
@@ -1441,10 +5092,14 @@ void TrainModel() {
 	}
 
 	max_train_words = 0;
+	if (resume_file[0] != 0)
+		OpenCheckpoint();
 	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
 		vocabs[lang_id] = calloc(vocab_max_size, sizeof(struct vocab_word));
-		vocab_hashes[lang_id] = calloc(vocab_hash_size, sizeof(int));
-		if (read_vocab_files[lang_id][0] != 0) {
+		if (resume_file[0] != 0) {
+			fprintf(stderr, "Reading vocab from checkpoint\n");
+			ReadCheckpointVocab(lang_id);
+		} else if (read_vocab_files[lang_id][0] != 0) {
 			fprintf(stderr, "Reading vocab\n");
 			ReadVocab(lang_id);
 		} else {
@@ -1456,6 +5111,19 @@ void TrainModel() {
 			fprintf(stderr, "Saving vocab\n");
 			SaveVocab(lang_id);
 		}
+		if (save_vocab_bin_files[lang_id][0] != 0)
+			SaveVocabBinary(lang_id);
+		if (preprocess) {
+			if (bin_train_files[lang_id][0] == 0) {
+				printf("ERROR: -preprocess needs -bin-train%d.\n", lang_id + 1);
+				exit(1);
+			}
+			fprintf(stderr, "Preprocessing training data\n");
+			PreprocessTrainFile(lang_id);
+			continue;
+		}
+		if (bin_train_files[lang_id][0] != 0)
+			MapTokenFile(lang_id);
 		if (!learn_vocab_and_quit && output_files[lang_id][0] == 0) { // 没有说只读取词表就可以，但是却没有指定输出文件
 			printf("ERROR: No output name specified.\n");
 			exit(1);
@@ -1465,13 +5133,23 @@ void TrainModel() {
 		InitNet(lang_id);
 		fprintf(stderr, "..done.\n");
 
-		fprintf(stderr, "Initializing unigram table..");
-		InitUnigramTable(lang_id);
-		fprintf(stderr, "..done.\n");
+		if (neg_sampler == SAMPLER_TABLE || sampler_bench > 0) {
+			fprintf(stderr, "Initializing unigram table..");
+			InitUnigramTable(lang_id);
+			fprintf(stderr, "..done.\n");
+		}
+		if (neg_sampler == SAMPLER_ALIAS || sampler_bench > 0)
+			InitAliasTable(lang_id);
 
 		if (train_words[lang_id] > max_train_words)
 			max_train_words = train_words[lang_id]; // ？？这是啥意思？
 	}
+	if (preprocess)
+		exit(0);
+	if (sampler_bench > 0) {
+		BenchSamplers();
+		exit(0);
+	}
 	fprintf(stderr, "Loading lexicon\n");
 	LoadLexicon();
 	fprintf(stderr, "..done.\n");
@@ -1487,58 +5165,79 @@ void TrainModel() {
 
 	fprintf(stderr, "Reading HowNet\n");
 	ReadHowNet();
+	InitHowNetIndex();
 	fprintf(stderr, "... done\n");
 
 	fprintf(stderr, "Initializing Sememe Embeddings\n");
 	InitNetSememe();
 	fprintf(stderr, "... done\n");
+	if (fused_aux != 0)
+		InitFusedAux();
 
+	if (resume_file[0] != 0) {
+		fprintf(stderr, "Loading checkpoint\n");
+		LoadCheckpoint();
+		fprintf(stderr, "... done\n");
+	}
+
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		if (use_mmap && corpus_tokens[lang_id] == NULL)
+			MapTrainFile(lang_id);
+		if (sent_index > 0)
+			InitShards(lang_id);
+	}
+
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++)
+		InitMatchCache(lang_id);
+	pthread_rwlock_init(&ivf_lock, NULL);
+	if (match_ivf > 0) {
+		fprintf(stderr, "Building IVF indexes\n");
+		for (lang_id = 0; lang_id < NUM_LANG; lang_id++)
+			RebuildIvf(lang_id);
+		if (match_ivf_rebuild > 0)
+			pthread_create(&ivf_pt, NULL, IvfRebuildThread, NULL);
+	}
 
-	pthread_rwlock_init(&lock, NULL); // 初始化读写锁，NULL表示使用缺省的读写锁属性
+	for (i = 0; i < TASK_KINDS; i++) {
+		pool_task_counts[i] = i == TASK_MONO ? NUM_LANG * num_threads : num_threads;
+		if (posix_memalign((void **) &pool_tasks[i], 64,
+		                   pool_task_counts[i] * sizeof(struct train_task))) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		memset(pool_tasks[i], 0, pool_task_counts[i] * sizeof(struct train_task));
+	}
+	if (!deterministic)
+		for (a = 0; a < num_threads; a++)
+			pthread_create(&pool_pt[a], NULL, PoolWorker, (void *) a);
 	start = clock();
 	fprintf(stderr, "Starting training.\n");
 
-	for (i = 0; i < NUM_EPOCHS; i++) {
+	for (i = resume_file[0] != 0 ? resume_header.epoch : 0; i < NUM_EPOCHS; i++) {
 		printf("Epoch = %d\n", i);
+		train_epoch = i;
 		alpha = starting_alpha * (NUM_EPOCHS - i) / NUM_EPOCHS; // 学习率递减
-		ALL_MONO_DONE = 0;
 		lang_updates[0] = 0;
 		lang_updates[1] = 0;
-
-		for (a = 0; a < NUM_LANG * num_threads; a++) {
-			pthread_create(&mono_pt[a], NULL, MonoModelThread, (void *) a); // a是当前线程的序号，作为参数传入函数中
-		}
-		for (a = 0; a < num_threads; a++) {
-			pthread_create(&lexicon_pt[a], NULL, LexiconThread, (void *) a);
-		}
-		for (a = 0; a < num_threads; a++) {
-			pthread_create(&sememe_pt[a], NULL, SememeThread, (void *) a);
-		}
-
-		for (a = 0; a < num_threads; a++) {
-			pthread_create(&matching_t2s_pt[a], NULL, MatchingT2SThread, (void *) a);
+		for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+			RefreshMatchCache(lang_id);
+			match_hits[lang_id] = match_searches[lang_id] = 0;
 		}
-		for (a = 0; a < num_threads; a++) {
-			pthread_create(&matching_s2t_pt[a], NULL, MatchingS2TThread, (void *) a);
+		if (resume_file[0] != 0 && i == resume_header.epoch) {
+			// continue an epoch that was interrupted after a -checkpoint-every point
+			lang_updates[0] = resume_header.lang_updates[0];
+			lang_updates[1] = resume_header.lang_updates[1];
 		}
 
-		for (a = 0; a < NUM_LANG * num_threads; a++)
-			pthread_join(mono_pt[a], NULL); // 以阻塞的形式等待该线程结束
-
-		pthread_rwlock_wrlock(&lock);
-		ALL_MONO_DONE = 1;
-		pthread_rwlock_unlock(&lock);
-
-		for (a = 0; a < num_threads; a++)
-			pthread_join(lexicon_pt[a], NULL);
-		for (a = 0; a < num_threads; a++)
-			pthread_join(sememe_pt[a], NULL);
-
-		for (a = 0; a < num_threads; a++)
-			pthread_join(matching_t2s_pt[a], NULL);
-
-		for (a = 0; a < num_threads; a++)
-			pthread_join(matching_s2t_pt[a], NULL);
+		RunEpoch();
+		if (debug_mode > 0 && match_drift > 0)
+			for (lang_id = 0; lang_id < NUM_LANG; lang_id++)
+				if (match_hits[lang_id] + match_searches[lang_id] > 0)
+					fprintf(stderr, "Matching language %d: %lld lookups, hit rate %.3f, re-search rate %.3f\n",
+					        lang_id + 1, match_hits[lang_id] + match_searches[lang_id],
+					        match_hits[lang_id] / (double) (match_hits[lang_id] + match_searches[lang_id]),
+					        match_searches[lang_id] / (double) (match_hits[lang_id] + match_searches[lang_id]));
 		// Save the word vectors
 		for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
 			char save_name[MAX_STRING];
@@ -1547,6 +5246,8 @@ void TrainModel() {
 		}
 		// 保存义原向量
 		SaveSememe();
+		if (checkpoint_file[0] != 0)
+			SaveCheckpoint(i + 1, 0);
 		//reset optimization
 		//		long long c, d;
 		//		if (adagrad) {
@@ -1563,7 +5264,23 @@ void TrainModel() {
 		//			word_count_actual = 0;
 		//		}
 	}
-	pthread_rwlock_destroy(&lock);
+	if (match_ivf > 0 && match_ivf_rebuild > 0) {
+		ivf_stop = 1;
+		pthread_join(ivf_pt, NULL);
+	}
+	pthread_mutex_lock(&pool_mutex);
+	pool_exit = 1;
+	pthread_cond_broadcast(&pool_start);
+	pthread_mutex_unlock(&pool_mutex);
+	if (!deterministic)
+		for (a = 0; a < num_threads; a++)
+			pthread_join(pool_pt[a], NULL);
+	for (lang_id = 0; lang_id < NUM_LANG; lang_id++) {
+		if (corpus_tokens[lang_id] != NULL)
+			UnmapTokenFile(lang_id);
+		else if (use_mmap)
+			UnmapTrainFile(lang_id);
+	}
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -1605,6 +5322,9 @@ int main(int argc, char **argv) {
 		printf("\t-sememe-lambda <float>\n");
 		printf("\t\tSememe term weight (default = 1)\n");
 
+		printf("\t-sememe-negative <int>\n");
+		printf("\t\tNumber of negative sememes sampled per HowNet word (default = number of sememes / 200)\n");
+
 		printf("\t-save-sememe <file>\n");
 		printf("\t\tUse <file> to save the resulting semememe vectors\n");
 
@@ -1627,9 +5347,57 @@ int main(int argc, char **argv) {
 		printf("\t\tNumber of negative examples; default is 5, common values are"
 		       " 5 - 10 (0 = not used)\n");
 
+		printf("\t-hogbatch <int>\n");
+		printf("\t\tSkip-gram only: train every window as a minibatch, all context words sharing the\n"
+		       "\t\tnegatives of the center word (default = 0)\n");
+
+		printf("\t-hot-rows <int>\n");
+		printf("\t\tTrain private copies of the input and output vectors of the <int> most frequent words in\n"
+		       "\t\tevery monolingual task; fp32 AdaGrad accumulators only (default = 0, off)\n");
+
+		printf("\t-hot-merge <int>\n");
+		printf("\t\tMerge the copies of -hot-rows into the shared vectors every <int> words (default = 10000)\n");
+
+		printf("\t-hot-merge-mode <string>\n");
+		printf("\t\tsum adds the changes of every copy, avg their average (default = sum)\n");
+
+		printf("\t-readers <int>\n");
+		printf("\t\tUse <int> threads that read and subsample the corpora ahead of the training threads;\n"
+		       "\t\twith -debug 1 or more, every epoch reports how full their queues were (default = 0,\n"
+		       "\t\tthe training threads read)\n");
+
+		printf("\t-sampler <string>\n");
+		printf("\t\tNegative sampler: table (a 1e8 entry unigram table per language) or alias (an alias\n"
+		       "\t\ttable of one entry per word, same distribution) (default = table)\n");
+
+		printf("\t-sampler-bench <int>\n");
+		printf("\t\tDraw <int> negatives of each language with both samplers, report their speed and\n"
+		       "\t\taccuracy and exit\n");
+
 		printf("\t-threads <int>\n");
 		printf("\t\tUse <int> threads (default 1)\n");
 
+		printf("\t-sent-index <int>\n");
+		printf("\t\tSplit the corpora on sentence boundaries into parts with equal token counts, using a\n"
+		       "\t\tsentence index kept in <corpus>.idx; 2 also shuffles the parts every epoch, 0 splits\n"
+		       "\t\tthe files by bytes (default = 1)\n");
+
+		printf("\t-mono-weight <float>, -lexicon-weight <float>, -sememe-weight <float>, -matching-weight <float>\n");
+		printf("\t\tRelative share of the threads' time for each objective; matching gets its weight in each\n"
+		       "\t\tdirection (defaults = 2, 1, 1, 1)\n");
+
+		printf("\t-fused-aux <float>\n");
+		printf("\t\tTrain the lexicon and sememe objectives of a word inside the monolingual pass, on\n"
+		       "\t\t<float> of its occurrences; a negative value -n trains every word about n times per\n"
+		       "\t\tepoch instead. Replaces the separate lexicon and sememe tasks (default = 0, off)\n");
+
+		printf("\t-seed <int>\n");
+		printf("\t\tSeed of the initialization and of the per-thread random streams (default = 1)\n");
+
+		printf("\t-deterministic <int>\n");
+		printf("\t\tRun the objectives in a fixed order on a single thread, so that a fixed -seed and -threads\n"
+		       "\t\tgive bit-identical vectors; also disables -match-ivf-rebuild (default = 0)\n");
+
 		printf("\t-min-count <int>\n");
 		printf("\t\tThis will discard words that appear less than <int> times; "
 		       "default is 5\n");
@@ -1642,6 +5410,8 @@ int main(int argc, char **argv) {
 
 		printf("\t-binary <int>\n");
 		printf("\t\tSave the resulting vectors in binary mode; default is 0 (off)\n");
+		printf("\t\tThe binary files have 64 byte aligned float rows that can be mapped in place,\n"
+		       "\t\tsee src/EmbeddingFile.py; 2 writes int8 rows with a scale and a norm per row instead\n");
 
 		printf("\t-save-vocabN <file>\n");
 		printf("\t\tThe vocabulary for language N will be saved to <file>\n");
@@ -1649,6 +5419,11 @@ int main(int argc, char **argv) {
 		printf("\t-read-vocabN <file>\n");
 		printf("\t\tThe vocabulary for language N will be read from <file>, not "
 		       "constructed from the training data\n");
+		printf("\t\t<file> may be a text or a binary vocabulary\n");
+
+		printf("\t-save-vocab-binN <file>\n");
+		printf("\t\tThe vocabulary for language N will also be saved to <file> in a binary format\n"
+		       "\t\tthat -read-vocabN maps back in without parsing\n");
 
 		printf("\t-epochs N\n");
 		printf("\t\tTrain for N epochs (default = 1)\n");
@@ -1665,12 +5440,58 @@ int main(int argc, char **argv) {
 		printf("\t-threshold <float>\n");
 		printf("\t\tThreshold for falling back to empty word (default = 0)\n");
 
+		printf("\t-match-ivf <int>\n");
+		printf("\t\tMatch words through an IVF index with <int> lists instead of an exact search;\n"
+		       "\t\tabout the square root of the vocabulary size is a good start (default = 0, exact)\n");
+
+		printf("\t-match-nprobe <int>\n");
+		printf("\t\tNumber of IVF lists scanned per word; more is slower but finds better matches (default = 8)\n");
+
+		printf("\t-match-ivf-rebuild <int>\n");
+		printf("\t\tRebuild the IVF indexes in the background every <int> seconds, 0 for never (default = 60)\n");
+
+		printf("\t-match-drift <float>\n");
+		printf("\t\tReuse the last match of a word while its norm and its match's norm changed by less than\n"
+		       "\t\tthis fraction; 0 searches every word on every pass (default = 0)\n");
+
+		printf("\t-match-max-age <int>\n");
+		printf("\t\tSearch a word again after its match was reused <int> times (default = 8)\n");
+
+		printf("\t-grad-precision <string>\n");
+		printf("\t\tStorage of the AdaGrad accumulators: fp32, or bf16 with stochastic rounding for half the memory (default = fp32)\n");
+
+		printf("\t-param-precision <string>\n");
+		printf("\t\tStorage of syn0 and syn1neg: fp32, or bf16 with stochastic rounding for half the memory (default = fp32)\n");
+
+		printf("\t-simd <string>\n");
+		printf("\t\tKernels of the inner loops: avx512, avx2, scalar or auto for the widest the CPU supports (default = auto)\n");
+
 		printf("\t-Mstep-iterations <int>\n");
 		printf("\t\tNumber of iterations in each M step (default = 1)\n");
 
 		printf("\t-dump-every N\n");
 		printf("\t\tSave intermediate embeddings during training every N steps if N>0, else every epoch/N steps\n");
 
+		printf("\t-mmap <int>\n");
+		printf("\t\tMemory-map the training corpora and tokenize them in place (default = 0)\n");
+
+		printf("\t-bin-trainN <file>\n");
+		printf("\t\tTrain language N from the pre-tokenized corpus <file> instead of the text data\n");
+
+		printf("\t-preprocess <int>\n");
+		printf("\t\tWrite the training data as pre-tokenized corpora to the -bin-trainN files and quit\n");
+
+		printf("\t-checkpoint <file>\n");
+		printf("\t\tSave the whole training state to <file> after every epoch\n");
+
+		printf("\t-checkpoint-every <int>\n");
+		printf("\t\tAlso save the checkpoint every <int> updates of language 1 (default = 0, off); such a\n"
+		       "\t\tcheckpoint resumes with the same -threads, and cannot be taken with -readers\n");
+
+		printf("\t-resume <file>\n");
+		printf("\t\tResume training from the checkpoint <file>; vocabulary learning and initialization\n"
+		       "\t\tare skipped\n");
+
 		printf("\t-learn-vocab-and-quit <int>\n");
 		printf("\t\tLearn and save vocab only\n");
 
@@ -1686,13 +5507,17 @@ int main(int argc, char **argv) {
 		lexicon_files[lang_id] = calloc(MAX_STRING, sizeof(char));
 		output_files[lang_id] = calloc(MAX_STRING, sizeof(char));
 		save_vocab_files[lang_id] = calloc(MAX_STRING, sizeof(char));
+		save_vocab_bin_files[lang_id] = calloc(MAX_STRING, sizeof(char));
 		read_vocab_files[lang_id] = calloc(MAX_STRING, sizeof(char));
+		bin_train_files[lang_id] = calloc(MAX_STRING, sizeof(char));
 		lang_updates[lang_id] = 0;
 		dump_iters[lang_id] = 0;
 	}
 	sememe_file = calloc(MAX_STRING, sizeof(char));
 	hownet_file = calloc(MAX_STRING, sizeof(char));
 	save_sememe_file = calloc(MAX_STRING, sizeof(char));
+	checkpoint_file = calloc(MAX_STRING, sizeof(char));
+	resume_file = calloc(MAX_STRING, sizeof(char));
 
 	if ((i = ArgPos((char *) "-size", argc, argv)) > 0)
 		layer1_size = atoi(argv[i + 1]);
@@ -1711,6 +5536,8 @@ int main(int argc, char **argv) {
 		strcpy(hownet_file, argv[i + 1]);
 	if ((i = ArgPos((char *) "-sememe-lambda", argc, argv)) > 0)
 		SEMEME_LAMBDA = atof(argv[i + 1]);
+	if ((i = ArgPos((char *) "-sememe-negative", argc, argv)) > 0)
+		sememe_negative = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-save-sememe", argc, argv)) > 0)
 		strcpy(save_sememe_file, argv[i + 1]);
 
@@ -1727,8 +5554,30 @@ int main(int argc, char **argv) {
 		strcpy(save_vocab_files[1], argv[i + 1]);
 	if ((i = ArgPos((char *) "-read-vocab2", argc, argv)) > 0)
 		strcpy(read_vocab_files[1], argv[i + 1]);
+	if ((i = ArgPos((char *) "-save-vocab-bin1", argc, argv)) > 0)
+		strcpy(save_vocab_bin_files[0], argv[i + 1]);
+	if ((i = ArgPos((char *) "-save-vocab-bin2", argc, argv)) > 0)
+		strcpy(save_vocab_bin_files[1], argv[i + 1]);
 	if ((i = ArgPos((char *) "-cbow", argc, argv)) > 0)
 		cbow = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-hogbatch", argc, argv)) > 0)
+		hogbatch = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-hot-rows", argc, argv)) > 0)
+		hot_rows = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *) "-hot-merge", argc, argv)) > 0)
+		hot_merge = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *) "-hot-merge-mode", argc, argv)) > 0) {
+		if (!strcmp(argv[i + 1], "sum"))
+			hot_merge_mode = HOT_MERGE_SUM;
+		else if (!strcmp(argv[i + 1], "avg"))
+			hot_merge_mode = HOT_MERGE_AVG;
+		else {
+			printf("ERROR: unknown -hot-merge-mode %s\n", argv[i + 1]);
+			exit(1);
+		}
+	}
+	if ((i = ArgPos((char *) "-readers", argc, argv)) > 0)
+		prefetch_readers = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-debug", argc, argv)) > 0)
 		debug_mode = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-binary", argc, argv)) > 0)
@@ -1744,6 +5593,44 @@ int main(int argc, char **argv) {
 		negative = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-threads", argc, argv)) > 0)
 		num_threads = atoi(argv[i + 1]);
+	if (num_threads < 1) {
+		printf("ERROR: -threads must be 1 or more\n");
+		exit(1);
+	}
+	if ((i = ArgPos((char *) "-sampler", argc, argv)) > 0) {
+		if (!strcmp(argv[i + 1], "table"))
+			neg_sampler = SAMPLER_TABLE;
+		else if (!strcmp(argv[i + 1], "alias"))
+			neg_sampler = SAMPLER_ALIAS;
+		else {
+			printf("ERROR: unknown -sampler %s\n", argv[i + 1]);
+			exit(1);
+		}
+	}
+	if ((i = ArgPos((char *) "-sampler-bench", argc, argv)) > 0)
+		sampler_bench = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *) "-sent-index", argc, argv)) > 0)
+		sent_index = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-mono-weight", argc, argv)) > 0)
+		task_weights[TASK_MONO] = atof(argv[i + 1]);
+	if ((i = ArgPos((char *) "-lexicon-weight", argc, argv)) > 0)
+		task_weights[TASK_LEXICON] = atof(argv[i + 1]);
+	if ((i = ArgPos((char *) "-sememe-weight", argc, argv)) > 0)
+		task_weights[TASK_SEMEME] = atof(argv[i + 1]);
+	if ((i = ArgPos((char *) "-matching-weight", argc, argv)) > 0)
+		task_weights[TASK_MATCH_T2S] = task_weights[TASK_MATCH_S2T] = atof(argv[i + 1]);
+	if (task_weights[TASK_MONO] <= 0) {
+		printf("ERROR: -mono-weight must be positive\n");
+		exit(1);
+	}
+	if ((i = ArgPos((char *) "-fused-aux", argc, argv)) > 0)
+		fused_aux = atof(argv[i + 1]);
+	if (fused_aux != 0)
+		task_weights[TASK_LEXICON] = task_weights[TASK_SEMEME] = 0;     // trained by the mono tasks
+	if ((i = ArgPos((char *) "-seed", argc, argv)) > 0)
+		seed = strtoull(argv[i + 1], NULL, 10);
+	if ((i = ArgPos((char *) "-deterministic", argc, argv)) > 0)
+		deterministic = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-min-count", argc, argv)) > 0)
 		min_count = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-early-stop", argc, argv)) > 0)
@@ -1758,12 +5645,80 @@ int main(int argc, char **argv) {
 		LEXICON_LAMBDA = atof(argv[i + 1]);
 	if ((i = ArgPos((char *) "-threshold", argc, argv)) > 0)
 		threshold = atof(argv[i + 1]);
+	if ((i = ArgPos((char *) "-match-ivf", argc, argv)) > 0)
+		match_ivf = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-match-nprobe", argc, argv)) > 0)
+		match_nprobe = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-match-ivf-rebuild", argc, argv)) > 0)
+		match_ivf_rebuild = atoi(argv[i + 1]);
+	if (match_ivf < 0) {
+		printf("ERROR: -match-ivf must be 0 or more\n");
+		exit(1);
+	}
+	if (match_nprobe < 1) {
+		printf("ERROR: -match-nprobe must be 1 or more\n");
+		exit(1);
+	}
+	if (deterministic)
+		match_ivf_rebuild = 0;  // the rebuilds land at arbitrary points of the epoch
+	if ((i = ArgPos((char *) "-match-drift", argc, argv)) > 0)
+		match_drift = atof(argv[i + 1]);
+	if ((i = ArgPos((char *) "-match-max-age", argc, argv)) > 0)
+		match_max_age = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-grad-precision", argc, argv)) > 0) {
+		if (!strcmp(argv[i + 1], "fp32"))
+			grad_precision = PRECISION_FP32;
+		else if (!strcmp(argv[i + 1], "bf16"))
+			grad_precision = PRECISION_BF16;
+		else {
+			printf("ERROR: unknown -grad-precision %s\n", argv[i + 1]);
+			exit(1);
+		}
+	}
+	if ((i = ArgPos((char *) "-param-precision", argc, argv)) > 0) {
+		if (!strcmp(argv[i + 1], "fp32"))
+			param_precision = PRECISION_FP32;
+		else if (!strcmp(argv[i + 1], "bf16"))
+			param_precision = PRECISION_BF16;
+		else {
+			printf("ERROR: unknown -param-precision %s\n", argv[i + 1]);
+			exit(1);
+		}
+	}
+	if (hot_rows > 0 && adagrad && grad_precision == PRECISION_BF16) {
+		printf("ERROR: -hot-rows needs -grad-precision fp32\n");
+		exit(1);
+	}
+	if (prefetch_readers < 0) {
+		printf("ERROR: -readers must be 0 or more\n");
+		exit(1);
+	}
+	if ((i = ArgPos((char *) "-simd", argc, argv)) > 0)
+		strcpy(simd_name, argv[i + 1]);
 	if ((i = ArgPos((char *) "-Mstep-iterations", argc, argv)) > 0)
 		MSTEP_ITER = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-dump-every", argc, argv)) > 0)
 		dump_every = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-learn-vocab-and-quit", argc, argv)) > 0)
 		learn_vocab_and_quit = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-mmap", argc, argv)) > 0)
+		use_mmap = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-bin-train1", argc, argv)) > 0)
+		strcpy(bin_train_files[0], argv[i + 1]);
+	if ((i = ArgPos((char *) "-bin-train2", argc, argv)) > 0)
+		strcpy(bin_train_files[1], argv[i + 1]);
+	if ((i = ArgPos((char *) "-preprocess", argc, argv)) > 0)
+		preprocess = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-checkpoint", argc, argv)) > 0)
+		strcpy(checkpoint_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-checkpoint-every", argc, argv)) > 0)
+		checkpoint_every = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *) "-resume", argc, argv)) > 0)
+		strcpy(resume_file, argv[i + 1]);
+	if (checkpoint_every > 0 && prefetch_readers > 0) {
+		printf("ERROR: -checkpoint-every cannot be used with -readers\n");
+		exit(1);
+	}
 
 	TrainModel();
 	return 0;
@@ -0,0 +1,102 @@
+# coding:utf8
+'''
+Loader of the binary embedding files written by CLSP-SE with -binary 1 or 2
+Layout: a 64-byte header (magic "CLSPEMB", version, dtype, count, dims, row stride,
+        word block offset and size, data offset), the offsets of all words into the
+        word block, the word block of NUL terminated strings, and one 64-byte aligned
+        row per word starting at the data offset
+        Rows of dtype 1 (-binary 2) are a float32 scale, the float32 norm of the
+        quantized row and dims int8 values; a value is scale * int8
+The rows are mapped with np.memmap, so no vector is parsed or copied when loading
+'''
+import numpy as np
+
+MAGIC = b"CLSPEMB\0"
+DTYPE_FLOAT32 = 0
+DTYPE_INT8 = 1
+
+headerType = np.dtype([("magic", "S8"), ("version", "<i4"), ("dtype", "<i4"),
+                       ("count", "<i8"), ("dims", "<i8"), ("rowStride", "<i8"),
+                       ("wordsOffset", "<i8"), ("wordsSize", "<i8"),
+                       ("dataOffset", "<i8")])
+
+
+def IsBinaryEmbedding(fileName):
+    '''
+    Check whether a file was written in the binary embedding format
+    '''
+    with open(fileName, "rb") as file:
+        return file.read(8) == MAGIC
+
+
+def MapBinaryEmbedding(fileName):
+    '''
+    Map a binary embedding file
+    Return its header, the list of words and the (count, rowStride) byte matrix of the rows
+    '''
+    header = np.fromfile(fileName, dtype=headerType, count=1)[0]
+    if header["magic"] != MAGIC.rstrip(b"\0") or header["version"] != 1:
+        raise ValueError("%s is not a binary embedding file" % fileName)
+    if int(header["dtype"]) not in (DTYPE_FLOAT32, DTYPE_INT8):
+        raise ValueError("%s has an unknown dtype %d" % (fileName, header["dtype"]))
+    count = int(header["count"])
+
+    wordBlock = np.memmap(fileName, dtype=np.uint8, mode="r",
+                          offset=int(header["wordsOffset"]),
+                          shape=(int(header["wordsSize"]),)).tobytes()
+    words = [w.decode("utf8") if not isinstance(w, str) else w
+             for w in wordBlock.split(b"\0")[:count]]
+
+    rows = np.memmap(fileName, dtype=np.uint8, mode="r",
+                     offset=int(header["dataOffset"]),
+                     shape=(count, int(header["rowStride"])))
+    return header, words, rows
+
+
+def LoadInt8Embedding(fileName):
+    '''
+    Map a binary embedding file written with -binary 2
+    Return the list of words, the (count, dims) int8 matrix and the scales and norms of
+    the rows; the cosine of rows i and j is
+    dot(q[i], q[j]) * scales[i] * scales[j] / (norms[i] * norms[j])
+    '''
+    header, words, rows = MapBinaryEmbedding(fileName)
+    if int(header["dtype"]) != DTYPE_INT8:
+        raise ValueError("%s is not an int8 embedding file" % fileName)
+    return (words,) + SplitInt8Rows(rows, int(header["dims"]))
+
+
+def DotInt8(q, v, block=4096):
+    '''
+    Dot products of the int8 rows q with the int8 vector v
+    The rows are widened to float32 one block at a time, so the matrix stays int8 while
+    the scan runs in BLAS; the products are exact integers for up to 1024 dims
+    '''
+    v = v.astype(np.float32)
+    dots = np.empty(len(q), dtype=np.float32)
+    for start in range(0, len(q), block):
+        dots[start:start + block] = np.dot(q[start:start + block].astype(np.float32), v)
+    return dots
+
+
+def SplitInt8Rows(rows, dims):
+    '''
+    Split mapped int8 rows into the int8 matrix, the scales and the norms
+    '''
+    scales = rows[:, 0:4].view(np.float32)[:, 0]
+    norms = rows[:, 4:8].view(np.float32)[:, 0]
+    return rows[:, 8:8 + dims].view(np.int8), scales, norms
+
+
+def LoadBinaryEmbedding(fileName):
+    '''
+    Map a binary embedding file
+    Return the list of words and a (count, dims) matrix; float32 files give a
+    read-only matrix backed by the file, int8 files are dequantized
+    '''
+    header, words, rows = MapBinaryEmbedding(fileName)
+    dims = int(header["dims"])
+    if int(header["dtype"]) == DTYPE_INT8:
+        q, scales, norms = SplitInt8Rows(rows, dims)
+        return words, q.astype(np.float32) * scales[:, None]
+    return words, rows.view(np.float32)[:, :dims]
@@ -9,6 +9,7 @@ import numpy as np
 from numpy import linalg
 import time
 import random
+from EmbeddingFile import IsBinaryEmbedding, LoadBinaryEmbedding
 
 
 outputPath = sys.argv[1]
@@ -24,6 +25,14 @@ def ReadWordVec(wordVecFile):
     '''
     start = time.clock()
     wordVecDict = {}
+    if IsBinaryEmbedding(wordVecFile):
+        words, vecs = LoadBinaryEmbedding(wordVecFile)
+        for word, vec in zip(words, vecs):
+            if linalg.norm(vec) > 0:
+                wordVecDict[word] = vec / linalg.norm(vec)
+        print('Word Embeddings Reading Complete, Total Number of words is: %d' % len(words))
+        print('Time Used: %f' % (time.clock() - start))
+        return wordVecDict
     with open(wordVecFile, 'r') as file:
         num = 0
         for line in file:
@@ -12,6 +12,8 @@ import numpy as np
 from numpy import linalg
 import time
 import random
+from EmbeddingFile import IsBinaryEmbedding, MapBinaryEmbedding, LoadBinaryEmbedding, \
+    LoadInt8Embedding, DotInt8, DTYPE_INT8
 
 
 outputPath = sys.argv[1]
@@ -65,10 +67,31 @@ def ReadWordVec(wordVecFile, HowNet):
     '''
     Read word vectors from the word embedding file
     Notice that we only keep the words which appear in the HowNet
+    Return the words, their vectors and the factors that turn dot products of
+    the vectors into cosine similarities; the int8 rows of -binary 2 files are
+    kept as they are, with scale / norm as their factors
     '''
     start = time.clock()
     wordVecDict = {}
     num = 0
+    if IsBinaryEmbedding(outputPath + wordVecFile):
+        header = MapBinaryEmbedding(outputPath + wordVecFile)[0]
+        if int(header["dtype"]) == DTYPE_INT8:
+            words, q, scales, norms = LoadInt8Embedding(outputPath + wordVecFile)
+            keep = [i for i, word in enumerate(words)
+                    if word in HowNet and norms[i] != 0 and scales[i] != 0]
+            print("Word Embeddings Reading Complete! Number of Words:: %d" % len(words))
+            print("Time Used: %f" % (time.clock() - start))
+            return ([words[i] for i in keep], np.array(q[keep]),
+                    scales[keep] / norms[keep])
+        words, vecs = LoadBinaryEmbedding(outputPath + wordVecFile)
+        for word, vec in zip(words, vecs):
+            num += 1
+            if word in HowNet and linalg.norm(vec) != 0:
+                wordVecDict[word] = vec / linalg.norm(vec)  # Normalization
+        print("Word Embeddings Reading Complete! Number of Words:: %d" % num)
+        print("Time Used: %f" % (time.clock() - start))
+        return StackWordVec(wordVecDict)
     with open(outputPath + wordVecFile, "r") as file:
         for line in file:
             num += 1
@@ -85,7 +108,25 @@ def ReadWordVec(wordVecFile, HowNet):
                             linalg.norm(vec)  # Normalization
     print("Word Embeddings Reading Complete! Number of Words:: %d" % num)
     print("Time Used: %f" % (time.clock() - start))
-    return wordVecDict
+    return StackWordVec(wordVecDict)
+
+
+def StackWordVec(wordVecDict):
+    '''
+    Stack normalized word vectors into the words, vectors and factors of ReadWordVec
+    '''
+    words = list(wordVecDict.keys())
+    vecs = np.array([wordVecDict[word] for word in words], dtype=np.float32)
+    return words, vecs, np.ones(len(words), dtype=np.float32)
+
+
+def Similarities(vecs, factors, vec, factor):
+    '''
+    Cosine similarities of vec to all the rows of vecs, int8 rows use integer dot products
+    '''
+    if vecs.dtype == np.int8:
+        return DotInt8(vecs, vec) * factors * factor
+    return np.dot(vecs, vec) * factors * factor
 
 
 def ReadWordFrequency(vocabFile, HowNet):
@@ -152,10 +193,10 @@ print("Start Reading Chinese HowNet")
 zhHowNet = ReadHowNet("HowNet_chinese_version.txt", SememeList)
 
 print("Start Reading English Word Vectors")
-enWordVecDict = ReadWordVec("word-vec.en", enHowNet)
+enWords, enVecs, enFactors = ReadWordVec("word-vec.en", enHowNet)
 
 print("Start Reading Chinese Word Vectors")
-zhWordVecDict = ReadWordVec("word-vec.zh", zhHowNet)
+zhWords, zhVecs, zhFactors = ReadWordVec("word-vec.zh", zhHowNet)
 
 print("Start Reading English Word Frequencies")
 enWordFreqDict = ReadWordFrequency("vocab.en", enHowNet)
@@ -168,7 +209,8 @@ simThresh = 0.5  # threshold of chosen sememe score
 
 start = time.clock()
 
-testWordList = enWordVecDict.keys()
+enWordIndex = dict((word, i) for i, word in enumerate(enWords))
+testWordList = list(enWords)
 random.shuffle(testWordList)
 testWordList = testWordList[:testNum]
 
@@ -180,15 +222,11 @@ for enWord in testWordList:
         print("Have looked for sememes for %d English words" % now)
         print("Time Used: %f" % (time.clock() - start))
 
-    enWordVec = enWordVecDict[enWord]
+    i = enWordIndex[enWord]
     # Sort source words according the cosine similarity
-    zhWordSimList = []
-    for zhWord in zhWordVecDict.keys():
-        zhWordVec = zhWordVecDict[zhWord]
-        cosSim = np.dot(zhWordVec, enWordVec)
-        zhWordSimList.append((zhWord, cosSim))
-    zhWordSimList.sort(key=lambda x: x[1], reverse=True)
-    zhWordSimList = zhWordSimList[:K]
+    sims = Similarities(zhVecs, zhFactors, enVecs[i], enFactors[i])
+    nearest = np.argsort(-sims, kind="mergesort")[:K]
+    zhWordSimList = [(zhWords[j], sims[j]) for j in nearest]
 
     # Calculate the score of each sememe
     sememeScore = {}